@@ -0,0 +1,86 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// a per-thread bump allocator, all allocations are released at once by reset()
+// chunks are kept between resets, so once warm an arena makes no heap allocations
+struct Arena {
+private:
+	static constexpr size_t CHUNK_SIZE = 1024 * 1024;
+
+	std::vector<std::unique_ptr<uint8_t[]>> _chunks;
+	std::vector<std::unique_ptr<uint8_t[]>> _oversized;
+	size_t _chunk = 0;
+	size_t _offset = 0;
+
+	static auto heapAllocate (const size_t size) {
+		Arena::heapAllocations += 1;
+		Arena::heapBytes += size;
+		return std::unique_ptr<uint8_t[]>(new uint8_t[size]);
+	}
+
+public:
+	// heap allocations made by all arenas, across all threads
+	static inline std::atomic_size_t heapAllocations = 0;
+	static inline std::atomic_size_t heapBytes = 0;
+
+	void* allocate (const size_t size, const size_t alignment) {
+		// too large to share a chunk
+		if (size > CHUNK_SIZE / 4) {
+			this->_oversized.emplace_back(Arena::heapAllocate(size));
+			return this->_oversized.back().get();
+		}
+
+		while (true) {
+			if (this->_chunk == this->_chunks.size()) {
+				this->_chunks.emplace_back(Arena::heapAllocate(CHUNK_SIZE));
+			}
+
+			const auto base = reinterpret_cast<uintptr_t>(this->_chunks[this->_chunk].get());
+			const auto offset = (base + this->_offset + alignment - 1) / alignment * alignment - base;
+			if (offset + size <= CHUNK_SIZE) {
+				this->_offset = offset + size;
+				return reinterpret_cast<void*>(base + offset);
+			}
+
+			++this->_chunk;
+			this->_offset = 0;
+		}
+	}
+
+	void reset () {
+		this->_oversized.clear();
+		this->_chunk = 0;
+		this->_offset = 0;
+	}
+
+	static Arena& local () {
+		thread_local Arena arena;
+		return arena;
+	}
+};
+
+// allocates from the calling thread's arena, deallocation is deferred until Arena::reset
+template <typename T>
+struct ArenaAllocator {
+	using value_type = T;
+
+	ArenaAllocator () {}
+	template <typename U> ArenaAllocator (const ArenaAllocator<U>&) {}
+
+	T* allocate (const size_t n) {
+		return static_cast<T*>(Arena::local().allocate(n * sizeof(T), alignof(T)));
+	}
+
+	void deallocate (T*, size_t) {}
+
+	template <typename U> bool operator== (const ArenaAllocator<U>&) const { return true; }
+	template <typename U> bool operator!= (const ArenaAllocator<U>&) const { return false; }
+};
+
+template <typename T>
+using arena_vector = std::vector<T, ArenaAllocator<T>>;
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <array>
+#include <cassert>
+#include <cstdint>
+
+#include "hash.hpp"
+
+// a 256-bit unsigned integer, for arithmetic on targets and chain work
+// limbs are little-endian, limbs[0] is the least significant
+struct arith_uint256 {
+	std::array<uint64_t, 4> limbs = {};
+
+	arith_uint256 () {}
+	arith_uint256 (const uint64_t x) : limbs{x, 0, 0, 0} {}
+
+	// from 32 big-endian bytes, as written by BlockBase::calculateTarget
+	static auto fromBE (const uint256_t& bytes) {
+		arith_uint256 x;
+		for (size_t i = 0; i < 32; ++i) {
+			x.limbs[3 - i / 8] |= static_cast<uint64_t>(bytes[i]) << (56 - 8 * (i % 8));
+		}
+
+		return x;
+	}
+
+	auto toBE () const {
+		uint256_t bytes;
+		for (size_t i = 0; i < 32; ++i) {
+			bytes[i] = static_cast<uint8_t>(this->limbs[3 - i / 8] >> (56 - 8 * (i % 8)));
+		}
+
+		return bytes;
+	}
+
+	auto& operator+= (const arith_uint256& b) {
+		uint64_t carry = 0;
+		for (size_t i = 0; i < 4; ++i) {
+			const auto sum = this->limbs[i] + b.limbs[i];
+			const auto carried = sum + carry;
+			carry = (sum < this->limbs[i]) | (carried < sum);
+			this->limbs[i] = carried;
+		}
+
+		return *this;
+	}
+
+	auto& operator-= (const arith_uint256& b) {
+		uint64_t borrow = 0;
+		for (size_t i = 0; i < 4; ++i) {
+			const auto difference = this->limbs[i] - b.limbs[i];
+			const auto borrowed = difference - borrow;
+			borrow = (this->limbs[i] < b.limbs[i]) | (difference < borrow);
+			this->limbs[i] = borrowed;
+		}
+
+		return *this;
+	}
+
+	auto operator~ () const {
+		arith_uint256 x;
+		for (size_t i = 0; i < 4; ++i) x.limbs[i] = ~this->limbs[i];
+		return x;
+	}
+
+	// the number of significant bits
+	size_t bits () const {
+		for (size_t i = 4; i-- > 0;) {
+			if (this->limbs[i] != 0) return 64 * i + 64 - static_cast<size_t>(__builtin_clzll(this->limbs[i]));
+		}
+
+		return 0;
+	}
+
+	auto& operator<<= (const size_t n) {
+		assert(n < 256);
+
+		const auto words = n / 64;
+		const auto shift = n % 64;
+		for (size_t i = 4; i-- > 0;) {
+			uint64_t x = 0;
+			if (i >= words) {
+				x = this->limbs[i - words] << shift;
+				if ((shift != 0) && (i > words)) x |= this->limbs[i - words - 1] >> (64 - shift);
+			}
+
+			this->limbs[i] = x;
+		}
+
+		return *this;
+	}
+
+	// shift-subtract long division, only as many steps as the quotient has bits
+	auto operator/ (const arith_uint256& divisor) const {
+		assert(divisor != arith_uint256());
+
+		arith_uint256 quotient;
+		const auto nBits = this->bits();
+		const auto dBits = divisor.bits();
+		if (nBits < dBits) return quotient;
+
+		auto remainder = *this;
+		auto shifted = divisor;
+		auto shift = nBits - dBits;
+		shifted <<= shift;
+
+		while (true) {
+			if (not (remainder < shifted)) {
+				remainder -= shifted;
+				quotient.limbs[shift / 64] |= uint64_t(1) << (shift % 64);
+			}
+
+			if (shift == 0) break;
+			--shift;
+
+			// shifted >>= 1
+			for (size_t i = 0; i < 4; ++i) {
+				shifted.limbs[i] = (shifted.limbs[i] >> 1) | ((i < 3) ? (shifted.limbs[i + 1] << 63) : 0);
+			}
+		}
+
+		return quotient;
+	}
+
+	friend auto operator+ (arith_uint256 a, const arith_uint256& b) {
+		return a += b;
+	}
+
+	friend bool operator< (const arith_uint256& a, const arith_uint256& b) {
+		for (size_t i = 4; i-- > 0;) {
+			if (a.limbs[i] != b.limbs[i]) return a.limbs[i] < b.limbs[i];
+		}
+
+		return false;
+	}
+
+	friend bool operator> (const arith_uint256& a, const arith_uint256& b) {
+		return b < a;
+	}
+
+	friend bool operator== (const arith_uint256& a, const arith_uint256& b) {
+		return a.limbs == b.limbs;
+	}
+
+	friend bool operator!= (const arith_uint256& a, const arith_uint256& b) {
+		return a.limbs != b.limbs;
+	}
+};
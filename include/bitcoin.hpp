@@ -4,9 +4,14 @@
 #include <array>
 #include <cassert>
 #include <cstdint>
+#include <optional>
+#include <utility>
 #include <vector>
 
+#include "arena.hpp"
+#include "arith.hpp"
 #include "hash.hpp"
+#include "hash-batch.hpp"
 #include "hexxer.hpp"
 #include "ranger.hpp"
 #include "serial.hpp"
@@ -30,19 +35,56 @@ struct TransactionBase {
 
 	struct Witness {
 		R data;
-		std::vector<R> stack;
+		arena_vector<R> stack;
 	};
 
 	R data;
+	R body; // inputs and outputs, as serialized
 	int32_t version;
-	std::vector<Input> inputs;
-	std::vector<Output> outputs;
-	std::vector<Witness> witnesses;
+	arena_vector<Input> inputs;
+	arena_vector<Output> outputs;
+	arena_vector<Witness> witnesses;
 	uint32_t locktime;
 
-	auto hash () const {
+	// the serialization without the segwit marker, flag and witnesses, as segments of data
+	auto stripped () const {
+		return std::array<R, 3>{{ this->data.take(4), this->body, this->data.drop(this->data.size() - 4) }};
+	}
+
+	auto txid () const {
+		if (this->witnesses.empty()) return hash256(this->data);
+
+		const auto segments = this->stripped();
+		return hash256({ segments[0], segments[1], segments[2] });
+	}
+
+	auto wtxid () const {
 		return hash256(this->data);
 	}
+
+	auto baseSize () const {
+		if (this->witnesses.empty()) return this->data.size();
+		return 4 + this->body.size() + 4;
+	}
+
+	auto weight () const {
+		return this->baseSize() * 3 + this->data.size();
+	}
+
+	auto vsize () const {
+		return (this->weight() + 3) / 4;
+	}
+};
+
+// the fixed fields of a transaction, as passed to a visitor
+template <typename R>
+struct TransactionSummary {
+	R data;
+	int32_t version;
+	uint64_t nInputs;
+	uint64_t nOutputs;
+	bool hasWitnesses;
+	uint32_t locktime;
 };
 
 namespace {
@@ -81,7 +123,8 @@ namespace {
 	auto readStack (R& r) {
 		const auto count = readVI(r);
 
-		std::vector<R> stack;
+		arena_vector<R> stack;
+		stack.reserve(std::min(count, static_cast<uint64_t>(r.size())));
 		for (uint64_t i = 0; i < count; ++i) {
 			stack.emplace_back(readRange(r, readVI(r)));
 		}
@@ -101,8 +144,10 @@ namespace {
 		const auto hasWitnesses = (marker == 0x00) && (flag == 0x01);
 		if (hasWitnesses) data = data.drop(2);
 
+		auto body = data;
 		const auto nInputs = readVI(data);
-		std::vector<typename Transaction::Input> inputs;
+		arena_vector<typename Transaction::Input> inputs;
+		inputs.reserve(std::min(nInputs, static_cast<uint64_t>(data.size())));
 
 		for (size_t i = 0; i < nInputs; ++i) {
 			auto isave = data;
@@ -112,81 +157,207 @@ namespace {
 			const auto scriptLen = readVI(data);
 			const auto script = readRange(data, scriptLen);
 			const auto sequence = serial::read<uint32_t>(data);
-			isave = isave.drop(data.size());
+			isave = isave.take(isave.size() - data.size());
 
 			inputs.emplace_back(typename Transaction::Input{isave, hash, vout, script, sequence});
 		}
 
 		const auto nOutputs = readVI(data);
-		std::vector<typename Transaction::Output> outputs;
+		arena_vector<typename Transaction::Output> outputs;
+		outputs.reserve(std::min(nOutputs, static_cast<uint64_t>(data.size())));
 
 		for (size_t i = 0; i < nOutputs; ++i) {
 			auto osave = data;
 			const auto value = serial::read<uint64_t>(data);
 			const auto scriptLen = readVI(data);
 			const auto script = readRange(data, scriptLen);
-			osave = osave.drop(data.size());
+			osave = osave.take(osave.size() - data.size());
 
 			outputs.emplace_back(typename Transaction::Output{osave, script, value});
 		}
 
-		std::vector<typename Transaction::Witness> witnesses;
+		body = body.take(body.size() - data.size());
+
+		arena_vector<typename Transaction::Witness> witnesses;
 		if (hasWitnesses) {
+			witnesses.reserve(inputs.size());
+
 			for (size_t i = 0; i < nInputs; ++i) {
 				auto wsave = data;
 				const auto stack = readStack(data);
-				wsave = wsave.drop(data.size());
+				wsave = wsave.take(wsave.size() - data.size());
 
 				witnesses.emplace_back(typename Transaction::Witness{wsave, std::move(stack)});
 			}
 		}
 
 		const auto locktime = serial::read<uint32_t>(data);
-		save = save.drop(data.size());
+		save = save.take(save.size() - data.size());
 
-		return Transaction{save, version, std::move(inputs), std::move(outputs), std::move(witnesses), locktime};
+		return Transaction{save, body, version, std::move(inputs), std::move(outputs), std::move(witnesses), locktime};
 	}
 
 	template <typename R>
 	auto readTransaction (R&& data) { return readTransaction<R>(data); }
+
+	// calls back visitor for each part of a transaction it declares (see VisitorBase), skipping everything else
+	template <typename R, typename V>
+	void visitTransaction (R& data, V& visitor) {
+		using Transaction = TransactionBase<R>;
+
+		auto save = data;
+		const auto version = serial::read<int32_t>(data);
+
+		// segregated witness
+		const auto marker = serial::peek<uint8_t>(data);
+		const auto flag = serial::peek<uint8_t>(data.drop(1));
+		const auto hasWitnesses = (marker == 0x00) && (flag == 0x01);
+		if (hasWitnesses) data = data.drop(2);
+
+		const auto nInputs = readVI(data);
+		for (size_t i = 0; i < nInputs; ++i) {
+			if constexpr (V::INPUT) {
+				auto isave = data;
+				const auto hash = readRange(data, 32);
+				const auto vout = serial::read<uint32_t>(data);
+
+				const auto scriptLen = readVI(data);
+				const auto script = readRange(data, scriptLen);
+				const auto sequence = serial::read<uint32_t>(data);
+				isave = isave.take(isave.size() - data.size());
+
+				visitor.input(typename Transaction::Input{isave, hash, vout, script, sequence});
+			} else {
+				data = data.drop(36);
+				const auto scriptLen = readVI(data);
+				data = data.drop(scriptLen + 4);
+			}
+		}
+
+		const auto nOutputs = readVI(data);
+		for (size_t i = 0; i < nOutputs; ++i) {
+			if constexpr (V::OUTPUT) {
+				auto osave = data;
+				const auto value = serial::read<uint64_t>(data);
+				const auto scriptLen = readVI(data);
+				const auto script = readRange(data, scriptLen);
+				osave = osave.take(osave.size() - data.size());
+
+				visitor.output(typename Transaction::Output{osave, script, value});
+			} else {
+				data = data.drop(8);
+				const auto scriptLen = readVI(data);
+				data = data.drop(scriptLen);
+			}
+		}
+
+		if (hasWitnesses) {
+			for (size_t i = 0; i < nInputs; ++i) {
+				if constexpr (V::WITNESS) {
+					auto wsave = data;
+					auto stack = readStack(data);
+					wsave = wsave.take(wsave.size() - data.size());
+
+					visitor.witness(typename Transaction::Witness{wsave, std::move(stack)});
+				} else {
+					const auto count = readVI(data);
+					for (size_t j = 0; j < count; ++j) {
+						const auto itemLen = readVI(data);
+						data = data.drop(itemLen);
+					}
+				}
+			}
+		}
+
+		const auto locktime = serial::read<uint32_t>(data);
+		save = save.take(save.size() - data.size());
+
+		if constexpr (V::TRANSACTION) {
+			visitor.transaction(TransactionSummary<R>{save, version, nInputs, nOutputs, hasWitnesses, locktime});
+		}
+	}
 }
 
+// a visitor that requires nothing, visitors override the flags (and callbacks) they need
+struct VisitorBase {
+	static constexpr bool HEADER = false;
+	static constexpr bool TRANSACTION = false;
+	static constexpr bool INPUT = false;
+	static constexpr bool OUTPUT = false;
+	static constexpr bool WITNESS = false;
+
+	template <typename R> void header (const R&) {}
+	template <typename T> void transaction (const T&) {}
+	template <typename I> void input (const I&) {}
+	template <typename O> void output (const O&) {}
+	template <typename W> void witness (const W&) {}
+};
+
+namespace {
+	// advances data past a transaction, reading only the lengths necessary to do so
+	template <typename R>
+	void skipTransaction (R& data) {
+		VisitorBase visitor;
+		visitTransaction(data, visitor);
+	}
+}
+
+// parses each transaction at most once, skipping those never looked at
 template <typename R>
 struct TransactionRange {
 private:
+	using Transaction = decltype(readTransaction(std::declval<R&>()));
+
 	size_t _count;
 	R _data;
-	R _save;
+	R _next;
+	std::optional<Transaction> _front;
 
 public:
-	TransactionRange (R data, size_t count) : _count(count), _data(data), _save(data.take(0)) {}
+	TransactionRange (R data, size_t count) : _count(count), _data(data), _next(data.take(0)) {}
 
 	auto empty () const { return this->_count == 0; }
 	auto size () const { return this->_count; }
-	auto front () {
-		this->_save = this->_data;
-		return readTransaction(this->_save);
+	const auto& front () {
+		if (not this->_front) {
+			this->_next = this->_data;
+			this->_front.emplace(readTransaction(this->_next));
+		}
+
+		return *this->_front;
 	}
 
 	void pop_front () {
 		assert(!this->empty());
 		--this->_count;
 
-		if (this->_save.empty()) {
-			readTransaction(this->_data);
+		if (not this->_front) {
+			skipTransaction(this->_data);
 			return;
 		}
 
-		this->_data = this->_save;
+		this->_data = this->_next;
+		this->_front.reset();
 	}
 };
 
 template <typename S>
 struct BlockBase {
+	// a run of consecutive transactions
+	struct Part {
+		S data;
+		uint64_t count;
+	};
+
 	S header;
 	S data;
 
-	BlockBase (S header, S data) : header(header), data(data) {}
+private:
+	uint256_t _hash;
+
+public:
+	BlockBase (S header, S data) : header(header), data(data), _hash(hash256(header)) {}
+	BlockBase (S header, S data, const uint256_t& hash) : header(header), data(data), _hash(hash) {}
 
 	static void calculateTarget (uint256_t& target, uint32_t bits) {
 		const auto exponent = ((bits & 0xff000000) >> 24) - 3;
@@ -197,22 +368,113 @@ struct BlockBase {
 		serial::place<uint32_t, true>(range(target).drop(i), mantissa);
 	}
 
+	// the expected number of hashes for a block of this target, 2^256 / (target + 1)
+	static auto calculateWork (const uint32_t bits) {
+		uint256_t bytes = {};
+		calculateTarget(bytes, bits);
+
+		// 2^256 doesn't fit, but is (~target / (target + 1)) + 1
+		const auto target = arith_uint256::fromBE(bytes);
+		const auto divisor = target + 1;
+		if (divisor == arith_uint256()) return arith_uint256();
+
+		return (~target / divisor) + 1;
+	}
+
 	auto bits () const {
 		return serial::peek<uint32_t>(this->header.drop(72));
 	}
 
-	auto hash () const {
-		return hash256(this->header);
+	const auto& hash () const {
+		return this->_hash;
 	}
 
 	auto previousBlockHash () const {
 		return this->header.drop(4).take(32);
 	}
 
-	auto transactions () const {
+	// every transaction in the block
+	auto whole () const {
 		auto copy = this->data;
 		const auto count = readVI(copy);
-		return TransactionRange<S>(copy, count);
+		return Part{copy, count};
+	}
+
+	// splits the transactions into parts of at least n bytes (excluding the last)
+	auto split (const size_t n) const {
+		std::vector<Part> parts;
+
+		const auto whole = this->whole();
+		auto data = whole.data;
+		auto part = Part{data, 0};
+
+		for (uint64_t i = 0; i < whole.count; ++i) {
+			skipTransaction(data);
+			++part.count;
+
+			if (part.data.size() - data.size() < n) continue;
+
+			parts.emplace_back(part);
+			part = Part{data, 0};
+		}
+
+		if (part.count > 0) parts.emplace_back(part);
+		return parts;
+	}
+
+	auto transactions (const Part& part) const {
+		return TransactionRange<S>(part.data, part.count);
+	}
+
+	auto transactions () const {
+		return this->transactions(this->whole());
+	}
+
+	// the txid of every transaction, in block order
+	auto transactionHashes () const {
+		arena_vector<hashbatch::Message> messages;
+
+		auto transactions = this->transactions();
+		messages.reserve(transactions.size());
+
+		while (not transactions.empty()) {
+			const auto& transaction = transactions.front();
+
+			if (transaction.witnesses.empty()) {
+				messages.emplace_back(transaction.data.begin(), transaction.data.size());
+			} else {
+				const auto segments = transaction.stripped();
+				messages.emplace_back(
+					hashbatch::Segment{segments[0].begin(), segments[0].size()},
+					hashbatch::Segment{segments[1].begin(), segments[1].size()},
+					hashbatch::Segment{segments[2].begin(), segments[2].size()}
+				);
+			}
+
+			transactions.pop_front();
+		}
+
+		return hash256Batch(messages);
+	}
+
+	// calls back visitor for each part of the block it declares, decoding nothing else
+	// for each transaction, input(), output() and witness() are called in order, then transaction()
+	template <typename V>
+	void visit (V& visitor) const {
+		if constexpr (V::HEADER) visitor.header(this->header);
+		if constexpr (V::TRANSACTION || V::INPUT || V::OUTPUT || V::WITNESS) {
+			this->visit(visitor, this->whole());
+		}
+	}
+
+	// as above, for only the transactions of part
+	template <typename V>
+	void visit (V& visitor, const Part& part) const {
+		auto copy = part.data;
+
+		for (uint64_t i = 0; i < part.count; ++i) {
+			visitTransaction(copy, visitor);
+		}
 	}
 
 	auto utc () const {
@@ -235,6 +497,11 @@ auto Block (const R& header, const R& data) {
 	return BlockBase<R>(header, data);
 }
 
+template <typename R>
+auto Block (const R& header, const R& data, const uint256_t& hash) {
+	return BlockBase<R>(header, data, hash);
+}
+
 // TODO: output can max-out ...
 template <typename R>
 void putASM (R& output, const R& script) {
@@ -245,7 +512,8 @@ void putASM (R& output, const R& script) {
 
 		// data
 		if ((opcode > OP_0) && (opcode <= OP_PUSHDATA4)) {
-			const auto dataLength = readPD(opcode, save);
+			const size_t prefixLength = opcode < OP_PUSHDATA1 ? 0 : opcode == OP_PUSHDATA1 ? 1 : opcode == OP_PUSHDATA2 ? 2 : 4;
+			const auto dataLength = prefixLength > save.size() ? 0xffffffff : readPD(opcode, save);
 			if (dataLength > save.size()) {
 				for (auto x : zstr_range("<ERROR>")) {
 					serial::put<char>(output, x);
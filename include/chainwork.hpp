@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <vector>
+
+#include "arith.hpp"
+#include "bitcoin.hpp"
+
+// the chain work of a block is its own, plus that of its parent
+// walks back only until a block of known work, so every block is visited once
+// parents[i] is noParent for a block with no known parent, bits(i) is its compact target
+// chainWork(i) is where the chain work of block i is kept, set only if known[i]
+// visit(i) is called once for each block as its chain work is set, after that of its parent
+template <typename I, typename B, typename W, typename V>
+void accumulateChainWork (const std::vector<I>& parents, const I noParent, std::vector<bool>& known, B bits, W chainWork, V visit) {
+	// the target changes rarely, so the division is done once per bits value
+	std::map<uint32_t, arith_uint256> works;
+	const auto work = [&](const uint32_t b) -> const auto& {
+		auto iter = works.find(b);
+		if (iter == works.end()) iter = works.emplace(b, BlockBase<Range<const uint8_t*>>::calculateWork(b)).first;
+		return iter->second;
+	};
+
+	std::vector<I> walk;
+	for (size_t i = 0; i < parents.size(); ++i) {
+		auto j = static_cast<I>(i);
+		arith_uint256 totalWork;
+
+		while (true) {
+			if (known[j]) {
+				totalWork = chainWork(j);
+				break;
+			}
+
+			walk.emplace_back(j);
+			if (parents[j] == noParent) break;
+
+			j = parents[j];
+		}
+
+		// then unwind
+		while (not walk.empty()) {
+			const auto k = walk.back();
+			walk.pop_back();
+
+			totalWork += work(bits(k));
+			chainWork(k) = totalWork;
+			known[k] = true;
+			visit(k);
+		}
+	}
+}
+
+// the block of most chain work, the first if tied, of the n for which eligible(i)
+template <typename W, typename E>
+std::optional<size_t> findMostWork (const size_t n, W chainWork, E eligible) {
+	std::optional<size_t> best;
+	arith_uint256 bestChainWork;
+
+	for (size_t i = 0; i < n; ++i) {
+		if (not eligible(i)) continue;
+
+		const auto& work = chainWork(i);
+		if (not (work > bestChainWork)) continue;
+
+		best = i;
+		bestChainWork = work;
+	}
+
+	return best;
+}
@@ -0,0 +1,379 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HASH_BATCH_X86
+#endif
+
+#include "hash.hpp"
+
+// multi-buffer SHA-256, hashing many independent messages at once
+namespace hashbatch {
+	struct Segment {
+		const uint8_t* data;
+		size_t size;
+	};
+
+	// a message made of up to 3 non-contiguous segments, hashed as if concatenated
+	struct Message {
+		std::array<Segment, 3> segments;
+
+		Message () : segments{} {}
+		Message (const uint8_t* data, const size_t size) : segments{} {
+			this->segments[0] = Segment{data, size};
+		}
+		Message (const Segment& a, const Segment& b, const Segment& c) : segments{{a, b, c}} {}
+
+		auto size () const {
+			return this->segments[0].size + this->segments[1].size + this->segments[2].size;
+		}
+	};
+
+	constexpr uint32_t K[64] = {
+		0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+		0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+		0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+		0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+		0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+		0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+		0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+		0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+	};
+
+	constexpr uint32_t H0[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	inline uint32_t readBE32 (const uint8_t* p) {
+		return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+	}
+
+	inline void writeBE32 (uint8_t* p, const uint32_t x) {
+		p[0] = static_cast<uint8_t>(x >> 24);
+		p[1] = static_cast<uint8_t>(x >> 16);
+		p[2] = static_cast<uint8_t>(x >> 8);
+		p[3] = static_cast<uint8_t>(x);
+	}
+
+	// yields the padded 64-byte blocks of a message, in order
+	// blocks wholly within a segment are read in place, only blocks spanning segments (or padding) are staged
+	struct BlockReader {
+	private:
+		std::array<Segment, 3> _segments;
+		size_t _segment;
+		size_t _remaining;
+		uint64_t _bits;
+		bool _padded;
+		std::array<uint8_t, 64> _staged;
+
+	public:
+		void reset (const Message& message) {
+			const auto size = message.size();
+
+			this->_segments = message.segments;
+			this->_segment = 0;
+			this->_remaining = (size + 9 + 63) / 64;
+			this->_bits = static_cast<uint64_t>(size) * 8;
+			this->_padded = false;
+		}
+
+		auto empty () const { return this->_remaining == 0; }
+		auto remaining () const { return this->_remaining; }
+
+		// returns up to n contiguous blocks (at least 1), and the number of blocks returned
+		const uint8_t* next (size_t& n) {
+			while ((this->_segment < 3) && (this->_segments[this->_segment].size == 0)) ++this->_segment;
+
+			if (this->_segment < 3) {
+				auto& segment = this->_segments[this->_segment];
+
+				if (segment.size >= 64) {
+					n = std::min(n, segment.size / 64);
+					const auto p = segment.data;
+					segment.data += 64 * n;
+					segment.size -= 64 * n;
+					this->_remaining -= n;
+					return p;
+				}
+			}
+
+			n = 1;
+			size_t filled = 0;
+			while ((filled < 64) && (this->_segment < 3)) {
+				auto& segment = this->_segments[this->_segment];
+				const auto take = std::min(64 - filled, segment.size);
+
+				memcpy(this->_staged.data() + filled, segment.data, take);
+				segment.data += take;
+				segment.size -= take;
+				filled += take;
+
+				if (segment.size == 0) ++this->_segment;
+			}
+
+			// end of message?
+			if (filled < 64) {
+				if (not this->_padded) {
+					this->_staged[filled++] = 0x80;
+					this->_padded = true;
+				}
+
+				memset(this->_staged.data() + filled, 0, 64 - filled);
+				if (this->_remaining == 1) {
+					writeBE32(this->_staged.data() + 56, static_cast<uint32_t>(this->_bits >> 32));
+					writeBE32(this->_staged.data() + 60, static_cast<uint32_t>(this->_bits));
+				}
+			}
+
+			--this->_remaining;
+			return this->_staged.data();
+		}
+
+		const uint8_t* next () {
+			size_t n = 1;
+			return this->next(n);
+		}
+	};
+
+#define HB_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define HB_S0(x) (HB_ROTR(x, 2) ^ HB_ROTR(x, 13) ^ HB_ROTR(x, 22))
+#define HB_S1(x) (HB_ROTR(x, 6) ^ HB_ROTR(x, 11) ^ HB_ROTR(x, 25))
+#define HB_s0(x) (HB_ROTR(x, 7) ^ HB_ROTR(x, 18) ^ ((x) >> 3))
+#define HB_s1(x) (HB_ROTR(x, 17) ^ HB_ROTR(x, 19) ^ ((x) >> 10))
+
+	// N lanes of SHA-256, each lane refilled with the next message as soon as its current one completes
+	template <typename V, size_t N>
+	__attribute__((always_inline)) inline void sha256Lanes (const Message* messages, const size_t count, uint256_t* out) {
+		V state[8];
+		std::array<BlockReader, N> readers;
+		std::array<size_t, N> jobs;
+		std::array<bool, N> active;
+		const std::array<uint8_t, 64> zeroes = {};
+
+		size_t nextJob = 0;
+		size_t nActive = 0;
+
+		const auto load = [&](const size_t lane) {
+			if (nextJob == count) {
+				active[lane] = false;
+				return;
+			}
+
+			readers[lane].reset(messages[nextJob]);
+			jobs[lane] = nextJob++;
+			active[lane] = true;
+			++nActive;
+
+			for (size_t i = 0; i < 8; ++i) state[i][lane] = H0[i];
+		};
+
+		for (size_t lane = 0; lane < N; ++lane) load(lane);
+
+		while (nActive > 0) {
+			// transpose one block from each lane
+			alignas(64) uint32_t words[16][N];
+			for (size_t lane = 0; lane < N; ++lane) {
+				const auto block = active[lane] ? readers[lane].next() : zeroes.data();
+				for (size_t t = 0; t < 16; ++t) words[t][lane] = readBE32(block + 4 * t);
+			}
+
+			V w[16];
+			memcpy(w, words, sizeof(w));
+
+			auto a = state[0], b = state[1], c = state[2], d = state[3];
+			auto e = state[4], f = state[5], g = state[6], h = state[7];
+
+			for (size_t t = 0; t < 64; ++t) {
+				if (t >= 16) {
+					w[t & 15] += HB_s1(w[(t - 2) & 15]) + w[(t - 7) & 15] + HB_s0(w[(t - 15) & 15]);
+				}
+
+				const V t1 = h + HB_S1(e) + ((e & f) ^ (~e & g)) + K[t] + w[t & 15];
+				const V t2 = HB_S0(a) + ((a & b) ^ (a & c) ^ (b & c));
+				h = g;
+				g = f;
+				f = e;
+				e = d + t1;
+				d = c;
+				c = b;
+				b = a;
+				a = t1 + t2;
+			}
+
+			state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+			state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+
+			// retire completed lanes
+			for (size_t lane = 0; lane < N; ++lane) {
+				if (not active[lane]) continue;
+				if (not readers[lane].empty()) continue;
+
+				for (size_t i = 0; i < 8; ++i) writeBE32(out[jobs[lane]].data() + 4 * i, state[i][lane]);
+				--nActive;
+				load(lane);
+			}
+		}
+	}
+
+#undef HB_ROTR
+#undef HB_S0
+#undef HB_S1
+#undef HB_s0
+#undef HB_s1
+
+	typedef uint32_t u32x4 __attribute__((vector_size(16)));
+	typedef uint32_t u32x8 __attribute__((vector_size(32)));
+	typedef uint32_t u32x16 __attribute__((vector_size(64)));
+
+	// portable vector extensions (e.g. NEON), on x86 only SSE2
+	inline void sha256x4 (const Message* messages, const size_t count, uint256_t* out) {
+		sha256Lanes<u32x4, 4>(messages, count, out);
+	}
+
+#ifdef HASH_BATCH_X86
+	__attribute__((target("avx2")))
+	inline void sha256x8 (const Message* messages, const size_t count, uint256_t* out) {
+		sha256Lanes<u32x8, 8>(messages, count, out);
+	}
+
+	__attribute__((target("avx512f")))
+	inline void sha256x16 (const Message* messages, const size_t count, uint256_t* out) {
+		sha256Lanes<u32x16, 16>(messages, count, out);
+	}
+
+	// SHA extensions, one message at a time
+	__attribute__((target("sha,sse4.1")))
+	inline void sha256Transform (uint32_t* state, const uint8_t* data, size_t nBlocks) {
+		const auto MASK = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+		auto tmp = _mm_loadu_si128(reinterpret_cast<const __m128i*>(state));
+		auto state1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(state + 4));
+
+		tmp = _mm_shuffle_epi32(tmp, 0xb1); // CDAB
+		state1 = _mm_shuffle_epi32(state1, 0x1b); // EFGH
+		auto state0 = _mm_alignr_epi8(tmp, state1, 8); // ABEF
+		state1 = _mm_blend_epi16(state1, tmp, 0xf0); // CDGH
+
+		for (; nBlocks > 0; --nBlocks, data += 64) {
+			const auto abefSave = state0;
+			const auto cdghSave = state1;
+			__m128i msgs[4];
+
+#pragma GCC unroll 16
+			for (size_t i = 0; i < 16; ++i) {
+				if (i < 4) {
+					msgs[i] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16 * i)), MASK);
+				}
+
+				auto msg = _mm_add_epi32(msgs[i % 4], _mm_loadu_si128(reinterpret_cast<const __m128i*>(K + 4 * i)));
+				state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+
+				if ((i >= 3) && (i <= 14)) {
+					const auto t = _mm_alignr_epi8(msgs[i % 4], msgs[(i + 3) % 4], 4);
+					msgs[(i + 1) % 4] = _mm_sha256msg2_epu32(_mm_add_epi32(msgs[(i + 1) % 4], t), msgs[i % 4]);
+				}
+
+				msg = _mm_shuffle_epi32(msg, 0x0e);
+				state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+
+				if ((i >= 1) && (i <= 12)) {
+					msgs[(i + 3) % 4] = _mm_sha256msg1_epu32(msgs[(i + 3) % 4], msgs[i % 4]);
+				}
+			}
+
+			state0 = _mm_add_epi32(state0, abefSave);
+			state1 = _mm_add_epi32(state1, cdghSave);
+		}
+
+		tmp = _mm_shuffle_epi32(state0, 0x1b); // FEBA
+		state1 = _mm_shuffle_epi32(state1, 0xb1); // DCHG
+		state0 = _mm_blend_epi16(tmp, state1, 0xf0); // DCBA
+		state1 = _mm_alignr_epi8(state1, tmp, 8); // ABEF
+
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(state), state0);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(state + 4), state1);
+	}
+
+	inline void sha256NI (const Message* messages, const size_t count, uint256_t* out) {
+		BlockReader reader;
+
+		for (size_t i = 0; i < count; ++i) {
+			uint32_t state[8];
+			memcpy(state, H0, sizeof(state));
+
+			reader.reset(messages[i]);
+			while (not reader.empty()) {
+				size_t n = reader.remaining();
+				const auto blocks = reader.next(n);
+				sha256Transform(state, blocks, n);
+			}
+
+			for (size_t j = 0; j < 8; ++j) writeBE32(out[i].data() + 4 * j, state[j]);
+		}
+	}
+#endif
+
+	// SHA-256 of each message, using the fastest engine the CPU supports
+	inline void sha256 (const Message* messages, const size_t count, uint256_t* out) {
+#ifdef HASH_BATCH_X86
+		static const auto hasAVX512 = __builtin_cpu_supports("avx512f");
+		static const auto hasSHA = __builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1");
+		static const auto hasAVX2 = __builtin_cpu_supports("avx2");
+
+		if (hasAVX512 && (count >= 16)) return sha256x16(messages, count, out);
+		if (hasSHA) return sha256NI(messages, count, out);
+		if (hasAVX2 && (count >= 8)) return sha256x8(messages, count, out);
+#else
+		if (count >= 4) return sha256x4(messages, count, out);
+#endif
+
+		// 4 lanes of SSE2 are slower than OpenSSL's own single-buffer assembly
+		for (size_t i = 0; i < count; ++i) {
+			SHA256_CTX context;
+			SHA256_Init(&context);
+			for (const auto& segment : messages[i].segments) {
+				SHA256_Update(&context, segment.data, segment.size);
+			}
+			SHA256_Final(out[i].data(), &context);
+		}
+	}
+}
+
+// hash256 of each message, all at once
+template <typename A>
+auto hash256Batch (const std::vector<hashbatch::Message, A>& messages) {
+	using hash_allocator_t = typename std::allocator_traits<A>::template rebind_alloc<uint256_t>;
+
+	std::vector<uint256_t, hash_allocator_t> hashes(messages.size(), messages.get_allocator());
+	hashbatch::sha256(messages.data(), messages.size(), hashes.data());
+
+	// second round, each message a single 32-byte digest
+	std::vector<hashbatch::Message, A> digests(messages.get_allocator());
+	digests.reserve(hashes.size());
+	for (const auto& hash : hashes) {
+		digests.emplace_back(hash.data(), hash.size());
+	}
+
+	std::vector<uint256_t, hash_allocator_t> results(messages.size(), messages.get_allocator());
+	hashbatch::sha256(digests.data(), digests.size(), results.data());
+	return results;
+}
+
+// hash256 of each range, all at once
+template <typename R, typename = std::enable_if_t<not std::is_same_v<R, hashbatch::Message>>>
+auto hash256Batch (const std::vector<R>& ranges) {
+	std::vector<hashbatch::Message> messages;
+	messages.reserve(ranges.size());
+	for (const auto& r : ranges) {
+		messages.emplace_back(r.begin(), r.size());
+	}
+
+	return hash256Batch(messages);
+}
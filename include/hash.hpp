@@ -1,6 +1,7 @@
 #pragma once
 
 #include <array>
+#include <initializer_list>
 #include <iomanip>
 #include <openssl/sha.h>
 #include <sstream>
@@ -20,12 +21,31 @@ auto sha256 (const R& r) {
 	return result;
 }
 
+// sha256 of the concatenation of each range, without copying
+template <typename R>
+auto sha256 (const std::initializer_list<R> rs) {
+	uint256_t result;
+	SHA256_CTX context;
+	SHA256_Init(&context);
+	for (const auto& r : rs) {
+		SHA256_Update(&context, r.begin(), r.size());
+	}
+	SHA256_Final(result.begin(), &context);
+	return result;
+}
+
 template <typename R>
 auto hash256 (const R& r) {
 	auto result = sha256(r);
 	return sha256(result);
 }
 
+template <typename R>
+auto hash256 (const std::initializer_list<R> rs) {
+	auto result = sha256(rs);
+	return sha256(result);
+}
+
 namespace {
 	template <typename R>
 	void putHex (R& output, const R& data) {
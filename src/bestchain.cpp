@@ -1,175 +1,522 @@
 #include <cstring>
 #include <iostream>
+#include <limits>
 #include <map>
+#include <string>
+#include <thread>
 #include <vector>
 
+#include "arith.hpp"
+#include "bitcoin.hpp"
+#include "chainwork.hpp"
 #include "hash.hpp"
+#include "hash-batch.hpp"
 #include "hvectors.hpp"
 #include "ranger.hpp"
 #include "serial.hpp"
 using namespace ranger;
 
-struct Block {
+struct BlockHeader {
 	uint256_t hash = {};
 	uint256_t prevBlockHash = {};
-	uint32_t bits;
-	uint64_t cachedChainWork;
+	uint32_t bits = 0;
+	uint32_t height = UNKNOWN_HEIGHT; // in the best chain
+	arith_uint256 chainWork;
 
-	Block () {}
-	Block (const uint256_t& hash, const uint256_t& prevBlockHash, const uint32_t bits) : hash(hash), prevBlockHash(prevBlockHash), bits(bits), cachedChainWork(0) {}
+	static constexpr uint32_t UNKNOWN_HEIGHT = 0xffffffff;
+
+	BlockHeader () {}
+	BlockHeader (const uint256_t& hash, const uint256_t& prevBlockHash, const uint32_t bits) : hash(hash), prevBlockHash(prevBlockHash), bits(bits) {}
 };
 
+static_assert(sizeof(BlockHeader) == 104);
+
+static constexpr auto NO_PARENT = std::numeric_limits<size_t>::max();
+
+// runs f(t) for each t in [0, n), each on its own thread
 template <typename F>
-auto walkChain (const HVector<uint256_t, Block>& blocks, Block visitor, F f) {
-	// naively walk the chain
-	while (true) {
-		const auto prevBlockIter = blocks.find(visitor.prevBlockHash);
+void parallel (const size_t n, F f) {
+	std::vector<std::thread> threads;
+	for (size_t t = 1; t < n; ++t) {
+		threads.emplace_back(f, t);
+	}
+
+	f(size_t(0));
+	for (auto& thread : threads) thread.join();
+}
 
-		// is the visitor a genesis block? (no prevBlockIter)
-		if (prevBlockIter == blocks.end()) break;
-		if (f(prevBlockIter->second)) break;
+// the t-th of n near equal parts of [0, size)
+auto share (const size_t size, const size_t t, const size_t n) {
+	return std::make_pair(size * t / n, size * (t + 1) / n);
+}
+
+// resolve the index of each block's parent, once
+auto findParents (const HVector<uint256_t, BlockHeader>& blocks, const size_t nThreads) {
+	std::vector<size_t> parents(blocks.size(), NO_PARENT);
+
+	parallel(nThreads, [&](const size_t t) {
+		const auto bounds = share(blocks.size(), t, nThreads);
+
+		for (auto i = bounds.first; i < bounds.second; ++i) {
+			const auto prevBlockIter = blocks.find(blocks[i].second.prevBlockHash);
+
+			// is the block a genesis block? (no prevBlockIter)
+			if (prevBlockIter == blocks.end()) continue;
+
+			parents[i] = static_cast<size_t>(prevBlockIter - blocks.begin());
+		}
+	});
 
-		visitor = prevBlockIter->second;
+	return parents;
+}
+
+// sorts a part of blocks on each thread, then merges pairs of parts, in parallel, until one remains
+void parallelSort (HVector<uint256_t, BlockHeader>& blocks, const size_t nThreads) {
+	const auto compare = [](const auto& a, const auto& b) {
+		return a.first < b.first;
+	};
+
+	const auto begin = [&](const size_t t) {
+		return blocks.begin() + static_cast<std::ptrdiff_t>(share(blocks.size(), t, nThreads).first);
+	};
+
+	parallel(nThreads, [&](const size_t t) {
+		std::sort(begin(t), begin(t + 1), compare);
+	});
+
+	for (size_t width = 1; width < nThreads; width *= 2) {
+		parallel((nThreads + 2 * width - 1) / (2 * width), [&](const size_t m) {
+			const auto first = m * 2 * width;
+			const auto middle = std::min(first + width, nThreads);
+			const auto last = std::min(first + 2 * width, nThreads);
+			if (middle == last) return;
+
+			std::inplace_merge(begin(first), begin(middle), begin(last), compare);
+		});
 	}
 }
 
-// find all blocks who have no children (chain tips)
-auto findChainTips (const HVector<uint256_t, Block>& blocks) {
-	std::map<uint256_t, bool> hasChildren;
+// reads 80-byte headers until EOF, hashing them in batches, on each thread
+auto readHeaders (FILE* file, const size_t nThreads) {
+	static constexpr size_t CHUNK_SIZE = 16 * 1024 * 1024;
+	static constexpr size_t BATCH_SIZE = 1024;
 
-	for (const auto& blockIter : blocks) {
-		const auto& block = blockIter.second;
+	std::vector<uint8_t> data;
+	while (true) {
+		const auto size = data.size();
+		data.resize(size + CHUNK_SIZE);
+
+		const auto read = fread(data.data() + size, 1, CHUNK_SIZE, file);
+		data.resize(size + read);
+		if (read < CHUNK_SIZE) break;
+	}
+
+	// any trailing partial header is ignored
+	HVector<uint256_t, BlockHeader> blocks;
+	blocks.resize(data.size() / 80);
+
+	parallel(nThreads, [&](const size_t t) {
+		const auto bounds = share(blocks.size(), t, nThreads);
+		std::vector<hashbatch::Message> messages;
 
+		for (auto i = bounds.first; i < bounds.second; i += BATCH_SIZE) {
+			const auto n = std::min(BATCH_SIZE, bounds.second - i);
+
+			messages.clear();
+			for (size_t j = 0; j < n; ++j) {
+				messages.emplace_back(data.data() + (i + j) * 80, 80);
+			}
+
+			const auto hashes = hash256Batch(messages);
+			for (size_t j = 0; j < n; ++j) {
+				const auto header = ptr_range(data).drop((i + j) * 80).take(80);
+				const auto bits = serial::peek<uint32_t>(header.drop(72));
+
+				uint256_t prevBlockHash;
+				memcpy(prevBlockHash.begin(), header.begin() + 4, 32);
+
+				blocks[i + j] = std::make_pair(hashes[j], BlockHeader(hashes[j], prevBlockHash, bits));
+			}
+		}
+	});
+
+	return blocks;
+}
+
+// find all blocks who have no children (chain tips)
+auto findChainTips (const std::vector<size_t>& parents) {
+	std::vector<bool> hasChildren(parents.size(), false);
+
+	for (const auto parent : parents) {
 		// ignore genesis block
-		if (blocks.find(block.prevBlockHash) == blocks.end()) continue;
+		if (parent == NO_PARENT) continue;
 
-		hasChildren[block.prevBlockHash] = true;
+		hasChildren[parent] = true;
 	}
 
-	std::vector<Block> tips;
-	for (const auto& blockIter : blocks) {
-		const auto& block = blockIter.second;
-
+	std::vector<size_t> tips;
+	for (size_t i = 0; i < parents.size(); ++i) {
 		// filter to only blocks who have no children
-		if (hasChildren.find(block.hash) != hasChildren.end()) continue;
+		if (hasChildren[i]) continue;
 
-		tips.emplace_back(block);
+		tips.emplace_back(i);
 	}
 
 	return tips;
 }
 
-auto determineWork (const HVector<uint256_t, Block>& blocks, const Block block) {
-	uint64_t totalWork = block.bits;
+// a branch off the best chain, ending at a chain tip
+struct Fork {
+	size_t length = 0;
+	uint32_t height = BlockHeader::UNKNOWN_HEIGHT; // of the last block shared with the best chain, if any
+};
+
+// walks back from each tip (but the best) until the best chain
+auto findForks (const HVector<uint256_t, BlockHeader>& blocks, const std::vector<size_t>& parents, const std::vector<size_t>& tips) {
+	std::vector<Fork> forks;
 
-	walkChain(blocks, block, [&](const Block& visitor) {
-		if (visitor.cachedChainWork != 0) {
-			totalWork += visitor.cachedChainWork;
-			return true;
+	for (const auto tip : tips) {
+		if (blocks[tip].second.height != BlockHeader::UNKNOWN_HEIGHT) continue;
+
+		Fork fork;
+		auto i = tip;
+		while ((i != NO_PARENT) && (blocks[i].second.height == BlockHeader::UNKNOWN_HEIGHT)) {
+			++fork.length;
+			i = parents[i];
 		}
 
-		totalWork += visitor.bits;
-		return false;
-	});
+		if (i != NO_PARENT) fork.height = blocks[i].second.height;
+		forks.emplace_back(fork);
+	}
 
-	return totalWork;
+	return forks;
 }
 
-auto findBestChain (HVector<uint256_t, Block>& blocks) {
-	auto bestBlock = Block();
-	uint64_t bestChainWork = 0;
+// the chain work of every block not yet known
+void determineWork (HVector<uint256_t, BlockHeader>& blocks, const std::vector<size_t>& parents, std::vector<bool>& known) {
+	accumulateChainWork(parents, NO_PARENT, known, [&](const size_t i) {
+		return blocks[i].second.bits;
+	}, [&](const size_t i) -> auto& {
+		return blocks[i].second.chainWork;
+	}, [](const size_t) {});
+}
 
-	for (auto& blockIter : blocks) {
-		auto& block = blockIter.second;
-		const auto chainWork = determineWork(blocks, block);
-		block.cachedChainWork = chainWork;
+// the block of most chain work, the first by hash if tied
+auto findBestTip (const HVector<uint256_t, BlockHeader>& blocks) {
+	const auto best = findMostWork(blocks.size(), [&](const size_t i) -> const auto& {
+		return blocks[i].second.chainWork;
+	}, [](const size_t) {
+		return true;
+	});
+
+	return best ? *best : NO_PARENT;
+}
 
-		if (chainWork > bestChainWork) {
-			bestBlock = block;
-			bestChainWork = chainWork;
+// moves the best chain from oldTip to tip, updating the height of each block
+// walks back only to the fork point, unless the old chain must be rebuilt
+// returns the blocks whose height changed
+auto updateHeights (HVector<uint256_t, BlockHeader>& blocks, const std::vector<size_t>& parents, size_t oldTip, const size_t tip, const bool rebuild) {
+	// each block whose height is set, with its previous height
+	std::vector<std::pair<size_t, uint32_t>> touched;
+	const auto setHeight = [&](const size_t i, const uint32_t height) {
+		touched.emplace_back(i, blocks[i].second.height);
+		blocks[i].second.height = height;
+	};
+
+	// the old chain may no longer start at a root, forget every height in it
+	if (rebuild) {
+		for (auto i = oldTip; (i != NO_PARENT) && (blocks[i].second.height != BlockHeader::UNKNOWN_HEIGHT); i = parents[i]) {
+			setHeight(i, BlockHeader::UNKNOWN_HEIGHT);
 		}
+
+		oldTip = NO_PARENT;
+	}
+
+	// the new branch, back to the first block already in the best chain
+	std::vector<size_t> branch;
+	auto fork = tip;
+	while ((fork != NO_PARENT) && (blocks[fork].second.height == BlockHeader::UNKNOWN_HEIGHT)) {
+		branch.emplace_back(fork);
+		fork = parents[fork];
 	}
 
-	std::vector<Block> blockchain;
-	blockchain.push_back(bestBlock);
+	// the old branch is no longer in the best chain (a reorg)
+	for (auto i = oldTip; (i != NO_PARENT) && (i != fork); i = parents[i]) {
+		setHeight(i, BlockHeader::UNKNOWN_HEIGHT);
+	}
 
-	walkChain(blocks, bestBlock, [&](const Block& visitor) {
-		blockchain.push_back(visitor);
-		return false;
+	auto height = (fork == NO_PARENT) ? 0 : blocks[fork].second.height + 1;
+	while (not branch.empty()) {
+		setHeight(branch.back(), height++);
+		branch.pop_back();
+	}
+
+	// the first height touched was the original
+	std::stable_sort(touched.begin(), touched.end(), [](const auto& a, const auto& b) {
+		return a.first < b.first;
 	});
 
-	std::reverse(blockchain.begin(), blockchain.end());
-	return blockchain;
+	std::vector<size_t> changed;
+	for (size_t i = 0; i < touched.size(); ++i) {
+		const auto index = touched[i].first;
+		if ((i > 0) && (touched[i - 1].first == index)) continue;
+		if (blocks[index].second.height == touched[i].second) continue;
+
+		changed.emplace_back(index);
+	}
+
+	return changed;
 }
 
-int main () {
-	HVector<uint256_t, Block> blocks;
+// the state of a previous run, so that only new headers need be read
+// MAGIC | N_BLOCKS | TIP | BLOCK_HEADER... | PARENT...
+static constexpr uint32_t STATE_MAGIC = 0x42504446; // FDPB
 
-	// read block headers from stdin until EOF
-	{
-		while (true) {
-			std::array<uint8_t, 80> header;
-			const auto read = fread(header.data(), header.size(), 1, stdin);
+auto loadState (const std::string& fileName, HVector<uint256_t, BlockHeader>& blocks, std::vector<size_t>& parents) {
+	auto tip = NO_PARENT;
+
+	const auto file = fopen(fileName.c_str(), "rb");
+	if (file == nullptr) {
+		std::cerr << "No state found at " << fileName << ", starting from empty" << std::endl;
+		return tip;
+	}
+
+	uint32_t magic = 0;
+	uint64_t nBlocks = 0;
+	auto ok = (fread(&magic, sizeof(magic), 1, file) == 1) && (magic == STATE_MAGIC);
+	ok = ok && (fread(&nBlocks, sizeof(nBlocks), 1, file) == 1);
+	ok = ok && (fread(&tip, sizeof(tip), 1, file) == 1);
+
+	if (ok) {
+		blocks.resize(nBlocks);
+		parents.resize(nBlocks);
+
+		for (size_t i = 0; ok && (i < nBlocks); ++i) {
+			ok = fread(&blocks[i].second, sizeof(BlockHeader), 1, file) == 1;
+			blocks[i].first = blocks[i].second.hash;
+		}
+
+		ok = ok && ((nBlocks == 0) || (fread(parents.data(), sizeof(size_t), nBlocks, file) == nBlocks));
+	}
+
+	fclose(file);
+	assert(ok);
+	assert(blocks.ready());
+
+	std::cerr << "Loaded state of " << blocks.size() << " headers from " << fileName << std::endl;
+	return tip;
+}
+
+void saveState (const std::string& fileName, const HVector<uint256_t, BlockHeader>& blocks, const std::vector<size_t>& parents, const size_t tip) {
+	const auto file = fopen(fileName.c_str(), "wb");
+	assert(file != nullptr);
+
+	const auto nBlocks = static_cast<uint64_t>(blocks.size());
+
+	auto ok = fwrite(&STATE_MAGIC, sizeof(STATE_MAGIC), 1, file) == 1;
+	ok = ok && (fwrite(&nBlocks, sizeof(nBlocks), 1, file) == 1);
+	ok = ok && (fwrite(&tip, sizeof(tip), 1, file) == 1);
+	for (const auto& blockIter : blocks) {
+		ok = ok && (fwrite(&blockIter.second, sizeof(BlockHeader), 1, file) == 1);
+	}
+	ok = ok && ((nBlocks == 0) || (fwrite(parents.data(), sizeof(size_t), nBlocks, file) == nBlocks));
+	assert(ok);
+
+	fclose(file);
+	std::cerr << "Wrote state of " << blocks.size() << " headers to " << fileName << std::endl;
+}
+
+// merges the (sorted) new headers into blocks, ignoring any already known
+// the parents and work of known blocks are kept, unless a new header is the missing parent of one
+// returns true if so, as any heights from the old tip are then wrong too
+auto mergeHeaders (HVector<uint256_t, BlockHeader>& blocks, std::vector<size_t>& parents, std::vector<bool>& known, const HVector<uint256_t, BlockHeader>& fresh, size_t& tip) {
+	HVector<uint256_t, BlockHeader> merged;
+	merged.reserve(blocks.size() + fresh.size());
+
+	// the index of each known block, once merged
+	std::vector<size_t> remap(blocks.size());
+
+	for (size_t i = 0, j = 0; (i < blocks.size()) || (j < fresh.size());) {
+		if ((j == fresh.size()) || ((i < blocks.size()) && not (fresh[j].first < blocks[i].first))) {
+			remap[i] = merged.size();
+			merged.emplace_back(blocks[i]);
+			++i;
+			continue;
+		}
+
+		// skip any already known, or repeated
+		if (merged.empty() || (merged.back().first != fresh[j].first)) merged.emplace_back(fresh[j]);
+		++j;
+	}
+
+	std::vector<size_t> mergedParents(merged.size(), NO_PARENT);
+	std::vector<bool> mergedKnown(merged.size(), false);
+	std::vector<bool> isOld(merged.size(), false);
+
+	for (size_t i = 0; i < blocks.size(); ++i) {
+		isOld[remap[i]] = true;
+		mergedKnown[remap[i]] = true;
+		if (parents[i] != NO_PARENT) mergedParents[remap[i]] = remap[parents[i]];
+	}
 
-			// EOF?
-			if (read == 0) break;
+	auto reconnected = false;
+	for (size_t i = 0; i < merged.size(); ++i) {
+		if (mergedParents[i] != NO_PARENT) continue;
 
-			const auto hash = hash256(header);
-			const auto bits = serial::peek<uint32_t>(range(header).drop(72));
+		const auto prevBlockIter = merged.find(merged[i].second.prevBlockHash);
+		if (prevBlockIter == merged.end()) continue;
 
-			uint256_t prevBlockHash;
-			memcpy(prevBlockHash.begin(), header.begin() + 4, 32);
+		mergedParents[i] = static_cast<size_t>(prevBlockIter - merged.begin());
+		reconnected |= isOld[i];
+	}
+
+	// the work of a known block, and its descendants, is wrong if it now has a parent
+	if (reconnected) {
+		std::cerr << "Found the missing parent of a known header, re-computing all chain work" << std::endl;
+		mergedKnown.assign(merged.size(), false);
+	}
+
+	if (tip != NO_PARENT) tip = remap[tip];
+	blocks.swap(merged);
+	parents.swap(mergedParents);
+	known.swap(mergedKnown);
+
+	return reconnected;
+}
+
+int main (int argc, char** argv) {
+	std::string stateFileName;
+	size_t nThreads = 1;
+	auto append = false;
+
+	// parse command line arguments
+	for (auto i = 1; i < argc; ++i) {
+		const auto arg = argv[i];
 
-			blocks.emplace_back(std::make_pair(hash, Block(hash, prevBlockHash, bits)));
+		// -s<FILENAME>, state to be written, and read with --append
+		if (strncmp(arg, "-s", 2) == 0) {
+			stateFileName = std::string(arg + 2);
+			continue;
 		}
 
-		std::cerr << "Read " << blocks.size() << " headers" << std::endl;
-		blocks.sort();
-		std::cerr << "Sorted " << blocks.size() << " headers" << std::endl;
+		if (sscanf(arg, "-j%zu", &nThreads) == 1) continue;
+
+		if (strcmp(arg, "--append") == 0) {
+			append = true;
+			continue;
+		}
+
+		std::cerr << "Unknown argument " << arg << std::endl;
+		assert(false);
 	}
 
-	// how many tips exist?
+	assert(nThreads > 0);
+	assert(not append || not stateFileName.empty());
+
+	HVector<uint256_t, BlockHeader> blocks;
+	std::vector<size_t> parents;
+	std::vector<bool> known;
+	auto oldTip = NO_PARENT;
+	auto rebuild = false;
+
+	if (append) oldTip = loadState(stateFileName, blocks, parents);
+
+	// read block headers from stdin until EOF
 	{
-		const auto chainTips = findChainTips(blocks);
-		std::cerr << "Found " << chainTips.size() << " chain tips" << std::endl;
+		auto fresh = readHeaders(stdin, nThreads);
+
+		std::cerr << "Read " << fresh.size() << " headers" << std::endl;
+		parallelSort(fresh, nThreads);
+		std::cerr << "Sorted " << fresh.size() << " headers" << std::endl;
+
+		if (append) {
+			const auto before = blocks.size();
+			rebuild = mergeHeaders(blocks, parents, known, fresh, oldTip);
+
+			std::cerr << "Merged " << blocks.size() - before << " new headers" << std::endl;
+		} else {
+			blocks.swap(fresh);
+			parents = findParents(blocks, nThreads);
+			known.assign(blocks.size(), false);
+		}
 	}
 
 	// what is the best?
-	const auto bestBlockChain = findBestChain(blocks);
+	determineWork(blocks, parents, known);
+
+	const auto tip = findBestTip(blocks);
+	if (tip == NO_PARENT) {
+		std::cerr << "No chain found" << std::endl;
+		return 0;
+	}
+
+	const auto changed = updateHeights(blocks, parents, oldTip, tip, rebuild);
 
 	// print some general information
 	{
-		const auto genesis = bestBlockChain.front();
-		const auto tip = bestBlockChain.back();
+		auto genesis = tip;
+		while (parents[genesis] != NO_PARENT) genesis = parents[genesis];
 
 		// output
 		std::cerr << "Best chain" << std::endl;
-		std::cerr << "- Height: " << bestBlockChain.size() - 1 << std::endl;
-		std::cerr << "- Genesis: " << toHexBE(genesis.hash) << std::endl;
-		std::cerr << "- Tip: " << toHexBE(tip.hash) << std::endl;
+		std::cerr << "- Height: " << blocks[tip].second.height << std::endl;
+		std::cerr << "- Genesis: " << toHexBE(blocks[genesis].second.hash) << std::endl;
+		std::cerr << "- Tip: " << toHexBE(blocks[tip].second.hash) << std::endl;
+		std::cerr << "- Chain work: " << toHex(blocks[tip].second.chainWork.toBE()) << std::endl;
+		if (append) std::cerr << "- Changed: " << changed.size() << " heights" << std::endl;
 	}
 
-	// output the best chain [in order]
+	// how many tips exist? and how far do they fork from the best chain?
 	{
-		HVector<uint256_t, uint32_t> blockChainMap;
+		const auto chainTips = findChainTips(parents);
+		std::cerr << "Found " << chainTips.size() << " chain tips" << std::endl;
 
-		int32_t height = 0;
-		for (const auto& block : bestBlockChain) {
-			blockChainMap.push_back(std::make_pair(block.hash, height));
-			++height;
+		const auto tipHeight = blocks[tip].second.height;
+		size_t detached = 0;
+		size_t longest = 0;
+		uint32_t deepest = 0;
+		std::map<size_t, size_t> lengths; // by power of 2
+
+		const auto forks = findForks(blocks, parents, chainTips);
+		for (const auto& fork : forks) {
+			// never joins the best chain
+			if (fork.height == BlockHeader::UNKNOWN_HEIGHT) {
+				++detached;
+				continue;
+			}
+
+			longest = std::max(longest, fork.length);
+			deepest = std::max(deepest, tipHeight - fork.height);
+			++lengths[63 - static_cast<size_t>(__builtin_clzll(fork.length))];
 		}
-		blockChainMap.sort();
 
+		std::cerr << "Forks" << std::endl;
+		std::cerr << "- Count: " << forks.size() - detached << std::endl;
+		std::cerr << "- Longest: " << longest << " blocks" << std::endl;
+		std::cerr << "- Deepest: " << deepest << " blocks below the tip" << std::endl;
+		for (const auto& length : lengths) {
+			const auto from = size_t(1) << length.first;
+			std::cerr << "- Of length " << from;
+			if (from > 1) std::cerr << "-" << 2 * from - 1;
+			std::cerr << ": " << length.second << std::endl;
+		}
+		std::cerr << "- Detached: " << detached << " (not joining the best chain)" << std::endl;
+	}
+
+	// output the best chain [in order], or with --append, only the blocks whose height changed
+	{
 		std::array<uint8_t, 36> buffer;
-		for (auto&& blockIter : blockChainMap) {
+		for (const auto i : changed) {
 			auto _data = range(buffer);
-			_data.put(range(blockIter.first));
-			serial::put<uint32_t>(_data, blockIter.second);
+			_data.put(range(blocks[i].first));
+			serial::put<uint32_t>(_data, blocks[i].second.height);
 			assert(_data.size() == 0);
 
 			fwrite(buffer.begin(), buffer.size(), 1, stdout);
 		}
 	}
 
+	if (not stateFileName.empty()) saveState(stateFileName, blocks, parents, tip);
+
 	return 0;
 }
@@ -0,0 +1,213 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "arith.hpp"
+#include "bitcoin.hpp"
+#include "chainwork.hpp"
+#include "hash.hpp"
+#include "hvectors.hpp"
+
+// the location of a block within the blocks directory
+struct IndexEntry {
+	uint256_t hash;
+	uint256_t prevBlockHash;
+	uint32_t file;
+	uint32_t offset; // of the header
+	uint32_t length; // of the header and transactions
+	uint32_t height; // in the best chain
+	uint32_t bits;
+};
+
+static_assert(sizeof(IndexEntry) == 84);
+
+// a persistent index of every block in a blocks directory, so later runs need not scan or verify anything
+// MAGIC | N_FILES | FILE_SIZE... | FILE_MODIFIED... | N_BLOCKS | ENTRY...
+// bitcoind pre-allocates blk*.dat files, so a file may be written to without changing its size
+// only the files whose size or modification time has changed are scanned again
+struct BlockIndex {
+	static constexpr uint32_t MAGIC = 0x33504446; // FDP3
+	static constexpr uint32_t UNKNOWN_HEIGHT = 0xffffffff;
+
+	std::vector<uint64_t> fileSizes;
+	std::vector<uint64_t> fileModified;
+	std::vector<IndexEntry> entries;
+
+	template <typename R>
+	void add (const uint256_t& hash, const R& prevBlockHash, const uint32_t bits, const uint32_t file, const size_t offset, const size_t length) {
+		assert(offset <= 0xffffffff);
+		assert(length <= 0xffffffff);
+
+		IndexEntry entry;
+		entry.hash = hash;
+		std::copy(prevBlockHash.begin(), prevBlockHash.end(), entry.prevBlockHash.begin());
+		entry.file = file;
+		entry.offset = static_cast<uint32_t>(offset);
+		entry.length = static_cast<uint32_t>(length);
+		entry.height = UNKNOWN_HEIGHT;
+		entry.bits = bits;
+
+		this->entries.emplace_back(entry);
+	}
+
+	// the height of each block in the best chain, that of most work from a genesis block
+	// blocks of stale forks, or of no known genesis block, are left at UNKNOWN_HEIGHT
+	void computeHeights () {
+		static constexpr uint32_t NO_PARENT = 0xffffffff;
+
+		HVector<uint256_t, uint32_t> indices;
+		for (size_t i = 0; i < this->entries.size(); ++i) {
+			indices.emplace_back(this->entries[i].hash, static_cast<uint32_t>(i));
+		}
+		indices.sort();
+
+		std::vector<uint32_t> parents(this->entries.size(), NO_PARENT);
+		for (size_t i = 0; i < this->entries.size(); ++i) {
+			const auto iter = indices.find(this->entries[i].prevBlockHash);
+			if (iter != indices.end()) parents[i] = iter->second;
+		}
+
+		// the depth of each block follows that of its parent, a root is only at depth 0 if it is a genesis block
+		const uint256_t genesisParent = {};
+		std::vector<uint32_t> depths(this->entries.size(), UNKNOWN_HEIGHT);
+		std::vector<arith_uint256> chainWorks(this->entries.size());
+		std::vector<bool> known(this->entries.size(), false);
+
+		accumulateChainWork(parents, NO_PARENT, known, [&](const uint32_t i) {
+			return this->entries[i].bits;
+		}, [&](const uint32_t i) -> auto& {
+			return chainWorks[i];
+		}, [&](const uint32_t i) {
+			const auto parent = parents[i];
+			if (parent == NO_PARENT) {
+				depths[i] = (this->entries[i].prevBlockHash == genesisParent) ? 0 : UNKNOWN_HEIGHT;
+			} else if (depths[parent] != UNKNOWN_HEIGHT) {
+				depths[i] = depths[parent] + 1;
+			}
+		});
+
+		for (auto& entry : this->entries) entry.height = UNKNOWN_HEIGHT;
+
+		const auto best = findMostWork(this->entries.size(), [&](const size_t i) -> const auto& {
+			return chainWorks[i];
+		}, [&](const size_t i) {
+			return depths[i] != UNKNOWN_HEIGHT;
+		});
+		if (not best) return;
+
+		for (auto i = static_cast<uint32_t>(*best); i != NO_PARENT; i = parents[i]) {
+			this->entries[i].height = depths[i];
+		}
+	}
+
+	// the entries at heights [from, to), in height order, then by file and offset
+	// height(entry) is the height to select an entry by, if any, e.g that of a whitelist
+	template <typename F>
+	auto select (const uint32_t from, const uint32_t to, F height) const {
+		std::vector<std::pair<uint32_t, const IndexEntry*>> selected;
+		for (const auto& e : this->entries) {
+			const auto h = height(e);
+			if (not h) continue;
+			if ((*h < from) || (*h >= to)) continue;
+
+			selected.emplace_back(*h, &e);
+		}
+
+		std::sort(selected.begin(), selected.end(), [](const auto& a, const auto& b) {
+			if (a.first != b.first) return a.first < b.first;
+			if (a.second->file != b.second->file) return a.second->file < b.second->file;
+			return a.second->offset < b.second->offset;
+		});
+
+		return selected;
+	}
+
+	// adds the entries of re-scanned files, keeping the entries in file order
+	void merge (const std::vector<IndexEntry>& scanned) {
+		this->entries.insert(this->entries.end(), scanned.begin(), scanned.end());
+		std::stable_sort(this->entries.begin(), this->entries.end(), [](const auto& a, const auto& b) {
+			return a.file < b.file;
+		});
+	}
+
+	// keeps the entries of each file whose size and modification time are unchanged since the index was written
+	// returns whether each file must be (re-)scanned, every file if the index is missing
+	auto load (const std::string& fileName, const std::vector<uint64_t>& expectedFileSizes, const std::vector<uint64_t>& expectedFileModified) {
+		const auto nExpected = expectedFileSizes.size();
+		std::vector<bool> stale(nExpected, true);
+
+		this->fileSizes = expectedFileSizes;
+		this->fileModified = expectedFileModified;
+		this->entries.clear();
+
+		const auto file = fopen(fileName.c_str(), "rb");
+		if (file == nullptr) return stale;
+
+		uint32_t magic = 0;
+		uint32_t nFiles = 0;
+		auto ok = (fread(&magic, sizeof(magic), 1, file) == 1) && (magic == MAGIC);
+		ok = ok && (fread(&nFiles, sizeof(nFiles), 1, file) == 1);
+
+		std::vector<uint64_t> sizes(nFiles);
+		std::vector<uint64_t> modified(nFiles);
+		ok = ok && ((nFiles == 0) || (fread(sizes.data(), sizeof(uint64_t), nFiles, file) == nFiles));
+		ok = ok && ((nFiles == 0) || (fread(modified.data(), sizeof(uint64_t), nFiles, file) == nFiles));
+
+		uint64_t nBlocks = 0;
+		ok = ok && (fread(&nBlocks, sizeof(nBlocks), 1, file) == 1);
+
+		std::vector<IndexEntry> written;
+		if (ok) {
+			written.resize(nBlocks);
+			ok = (nBlocks == 0) || (fread(written.data(), sizeof(IndexEntry), nBlocks, file) == nBlocks);
+		}
+
+		fclose(file);
+
+		if (not ok) {
+			std::cerr << "Index " << fileName << " is unreadable, re-scanning" << std::endl;
+			return stale;
+		}
+
+		for (size_t i = 0; i < std::min(size_t(nFiles), nExpected); ++i) {
+			stale[i] = (sizes[i] != expectedFileSizes[i]) || (modified[i] != expectedFileModified[i]);
+		}
+
+		for (const auto& entry : written) {
+			if ((entry.file < nExpected) && not stale[entry.file]) this->entries.emplace_back(entry);
+		}
+
+		const auto nStale = static_cast<size_t>(std::count(stale.begin(), stale.end(), true));
+		std::cerr << "Loaded index of " << this->entries.size() << " blocks from " << fileName;
+		if (nStale > 0) std::cerr << ", " << nStale << " block files changed, re-scanning those";
+		std::cerr << std::endl;
+
+		return stale;
+	}
+
+	void save (const std::string& fileName) const {
+		const auto file = fopen(fileName.c_str(), "wb");
+		assert(file != nullptr);
+
+		const auto nFiles = static_cast<uint32_t>(this->fileSizes.size());
+		const auto nBlocks = static_cast<uint64_t>(this->entries.size());
+
+		auto ok = fwrite(&MAGIC, sizeof(MAGIC), 1, file) == 1;
+		ok = ok && (fwrite(&nFiles, sizeof(nFiles), 1, file) == 1);
+		ok = ok && ((nFiles == 0) || (fwrite(this->fileSizes.data(), sizeof(uint64_t), nFiles, file) == nFiles));
+		ok = ok && ((nFiles == 0) || (fwrite(this->fileModified.data(), sizeof(uint64_t), nFiles, file) == nFiles));
+		ok = ok && (fwrite(&nBlocks, sizeof(nBlocks), 1, file) == 1);
+		ok = ok && ((nBlocks == 0) || (fwrite(this->entries.data(), sizeof(IndexEntry), nBlocks, file) == nBlocks));
+		assert(ok);
+
+		fclose(file);
+		std::cerr << "Wrote index of " << this->entries.size() << " blocks to " << fileName << std::endl;
+	}
+};
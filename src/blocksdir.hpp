@@ -0,0 +1,442 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "blockindex.hpp"
+#include "buffers.hpp"
+#include "obfuscation.hpp"
+#include "ranger.hpp"
+#include "scanner.hpp"
+
+// returns the blk*.dat files in a blocks directory, ordered by file number
+auto listBlockFiles (const std::string& directory) {
+	std::vector<std::string> files;
+
+	const auto dir = opendir(directory.c_str());
+	assert(dir != nullptr);
+
+	while (const auto entry = readdir(dir)) {
+		const auto name = std::string(entry->d_name);
+		if (name.size() != 12) continue;
+		if (name.compare(0, 3, "blk") != 0) continue;
+		if (name.compare(8, 4, ".dat") != 0) continue;
+
+		files.emplace_back(directory + "/" + name);
+	}
+
+	closedir(dir);
+
+	// blkNNNNN.dat is zero padded, lexicographic order is file order
+	std::sort(files.begin(), files.end());
+	return files;
+}
+
+auto fileSize (const std::string& fileName) {
+	struct stat st;
+	const auto error = stat(fileName.c_str(), &st);
+	assert(error == 0);
+
+	return static_cast<uint64_t>(st.st_size);
+}
+
+// the last modification time, in nanoseconds
+auto fileModified (const std::string& fileName) {
+	struct stat st;
+	const auto error = stat(fileName.c_str(), &st);
+	assert(error == 0);
+
+	return static_cast<uint64_t>(st.st_mtim.tv_sec) * 1000000000 + static_cast<uint64_t>(st.st_mtim.tv_nsec);
+}
+
+// a file open for reading, closed with its last reference
+struct OpenFile {
+	int fd = -1;
+
+	OpenFile (const std::string& fileName) {
+		this->fd = open(fileName.c_str(), O_RDONLY);
+		assert(this->fd != -1);
+	}
+
+	OpenFile (const OpenFile&) = delete;
+	OpenFile& operator= (const OpenFile&) = delete;
+
+	~OpenFile () {
+		close(this->fd);
+	}
+
+	// asks the kernel to start reading a range of the file
+	void prefetch (const size_t offset, const size_t length) const {
+		posix_fadvise(this->fd, static_cast<off_t>(offset), static_cast<off_t>(length), POSIX_FADV_WILLNEED);
+	}
+};
+
+// a read-only, private memory mapping of an entire file
+struct MappedFile {
+private:
+	uint8_t* _data = nullptr;
+	size_t _size = 0;
+
+public:
+	// advice is given to madvise, e.g MADV_RANDOM if only some blocks are read
+	// if writable, writes are private to the mapping (copy-on-write) and never reach the file
+	MappedFile (const std::string& fileName, const int advice = MADV_SEQUENTIAL, const bool writable = false) {
+		const auto fd = open(fileName.c_str(), O_RDONLY);
+		assert(fd != -1);
+
+		struct stat st;
+		const auto error = fstat(fd, &st);
+		assert(error == 0);
+		this->_size = static_cast<size_t>(st.st_size);
+
+		if (this->_size > 0) {
+			const auto protection = writable ? (PROT_READ | PROT_WRITE) : PROT_READ;
+			const auto mapping = mmap(nullptr, this->_size, protection, MAP_PRIVATE, fd, 0);
+			assert(mapping != MAP_FAILED);
+
+			this->_data = static_cast<uint8_t*>(mapping);
+			madvise(mapping, this->_size, advice);
+		}
+
+		close(fd);
+	}
+
+	MappedFile (const MappedFile&) = delete;
+	MappedFile& operator= (const MappedFile&) = delete;
+
+	~MappedFile () {
+		if (this->_data != nullptr) munmap(this->_data, this->_size);
+	}
+
+	// asks the kernel to start reading a range of the file
+	void prefetch (const size_t offset, const size_t length) const {
+		static const auto pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+		assert(offset + length <= this->_size);
+
+		const auto begin = offset / pageSize * pageSize;
+		madvise(this->_data + begin, offset + length - begin, MADV_WILLNEED);
+	}
+
+	auto data () const { return this->_data; }
+	auto size () const { return this->_size; }
+};
+
+// the blk*.dat files of a blocks directory, and its obfuscation key
+struct BlockFiles {
+	std::vector<std::string> names;
+	std::vector<uint64_t> sizes;
+	std::vector<uint64_t> modified;
+	XorKey key;
+
+	BlockFiles (const std::string& directory) : names(listBlockFiles(directory)) {
+		for (const auto& name : this->names) {
+			this->sizes.emplace_back(fileSize(name));
+			this->modified.emplace_back(fileModified(name));
+		}
+	}
+
+	// indexes each stale file by its headers alone, then recomputes the heights
+	void update (BlockIndex& index, const std::vector<bool>& stale, size_t& skipped) const {
+		std::vector<IndexEntry> scanned;
+
+		for (size_t i = 0; i < this->names.size(); ++i) {
+			if (not stale[i]) continue;
+
+			const OpenFile file(this->names[i]);
+			BlockIndex fileIndex;
+			scanHeaders(file.fd, this->sizes[i], this->key, skipped, [&](const auto& header, const size_t offset, const size_t length, const uint256_t& hash) {
+				fileIndex.add(hash, header.drop(4).take(32), serial::peek<uint32_t>(header.drop(72)), static_cast<uint32_t>(i), offset, length);
+			});
+
+			scanned.insert(scanned.end(), fileIndex.entries.begin(), fileIndex.entries.end());
+			std::cerr << "-- Indexed " << fileIndex.entries.size() << " blocks (" << this->names[i] << ")" << std::endl;
+		}
+
+		index.merge(scanned);
+		index.computeHeights();
+	}
+
+	// reads every file, each on one of nReaders threads, but dispatched in file order
+	// files that aren't stale are read at their index entries, any others are scanned, their entries added to scanned
+	// if headerOnly, only the headers are read, otherwise each file is mapped and de-obfuscated in place
+	template <typename D>
+	void read (D& dispatcher, const BlockIndex& index, const std::vector<bool>& stale, std::vector<IndexEntry>* scanned, const bool headerOnly, const size_t nReaders, size_t& accum, size_t& skipped) const {
+		using range_t = decltype(ptr_range(std::vector<uint8_t>()));
+		using block_t = decltype(Block(std::declval<range_t>(), std::declval<range_t>()));
+
+		struct ReadFile {
+			bool done = false;
+			std::shared_ptr<const void> owner;
+			std::optional<range_t> data;
+			std::vector<block_t> blocks;
+			BlockIndex index;
+			size_t bytes = 0;
+			size_t skipped = 0;
+		};
+
+		// the index entries of file i are [entryOffsets[i], entryOffsets[i + 1])
+		const auto nFiles = this->names.size();
+		std::vector<size_t> entryOffsets(nFiles + 1, index.entries.size());
+		for (size_t i = nFiles, j = index.entries.size(); i-- > 0;) {
+			while ((j > 0) && (index.entries[j - 1].file >= i)) --j;
+			entryOffsets[i] = j;
+		}
+
+		const auto readFile = [&](const size_t i, ReadFile& result) {
+			const auto& fileName = this->names[i];
+			const auto entries = range(index.entries).drop(entryOffsets[i]).take(entryOffsets[i + 1] - entryOffsets[i]);
+
+			// read the headers of the file to a buffer of their own
+			if (headerOnly) {
+				const OpenFile file(fileName);
+				const auto headers = std::make_shared<std::vector<uint8_t>>();
+				std::vector<uint256_t> hashes;
+
+				if (not stale[i]) {
+					std::array<uint8_t, 80> buffer;
+
+					for (const auto& e : entries) {
+						const auto header = preadRange(file.fd, buffer, e.offset, 80, this->key);
+						headers->insert(headers->end(), header.begin(), header.end());
+						hashes.emplace_back(e.hash);
+					}
+				} else {
+					scanHeaders(file.fd, this->sizes[i], this->key, result.skipped, [&](const auto& header, const size_t offset, const size_t length, const uint256_t& hash) {
+						headers->insert(headers->end(), header.begin(), header.end());
+						hashes.emplace_back(hash);
+
+						if (scanned != nullptr) result.index.add(hash, header.drop(4).take(32), serial::peek<uint32_t>(header.drop(72)), static_cast<uint32_t>(i), offset, length);
+					});
+				}
+
+				const auto buffer = ptr_range(*headers);
+				for (size_t j = 0; j < hashes.size(); ++j) {
+					const auto header = buffer.drop(j * 80).take(80);
+					result.blocks.emplace_back(Block(header, header.drop(80), hashes[j]));
+				}
+
+				result.owner = headers;
+				result.data = buffer;
+				result.bytes = headers->size();
+				return;
+			}
+
+			// the mapping is released once the last block referencing it is processed
+			const auto file = std::make_shared<MappedFile>(fileName, MADV_SEQUENTIAL, not this->key.empty());
+			const auto fileData = ptr_range(*file);
+			this->key.apply(file->data(), file->size(), 0);
+
+			if (not stale[i]) {
+				for (const auto& e : entries) {
+					const auto r = fileData.drop(e.offset).take(e.length);
+					result.blocks.emplace_back(Block(r.take(80), r.drop(80), e.hash));
+				}
+			} else {
+				scanBlocks(fileData, result.skipped, [&](const block_t& block) {
+					if (scanned != nullptr) {
+						const auto offset = static_cast<size_t>(block.header.begin() - fileData.begin());
+						result.index.add(block.hash(), block.previousBlockHash(), block.bits(), static_cast<uint32_t>(i), offset, 80 + block.data.size());
+					}
+
+					result.blocks.emplace_back(block);
+				});
+			}
+
+			result.owner = file;
+			result.data = fileData;
+			result.bytes = file->size();
+		};
+
+		std::vector<ReadFile> readFiles(nFiles);
+		std::mutex readMutex;
+		std::condition_variable readChanged;
+		size_t nextRead = 0;
+		size_t nextDispatch = 0;
+
+		// readers stay at most 2 files each ahead of the dispatcher
+		std::vector<std::thread> readers;
+		for (size_t r = 0; r < std::min(nReaders, nFiles); ++r) {
+			readers.emplace_back([&]() {
+				while (true) {
+					size_t i = 0;
+					{
+						std::unique_lock<std::mutex> lock(readMutex);
+						readChanged.wait(lock, [&]() {
+							return (nextRead == nFiles) || (nextRead < nextDispatch + 2 * nReaders);
+						});
+
+						if (nextRead == nFiles) return;
+						i = nextRead++;
+					}
+
+					ReadFile result;
+					readFile(i, result);
+					result.done = true;
+
+					{
+						std::lock_guard<std::mutex> lock(readMutex);
+						readFiles[i] = std::move(result);
+					}
+					readChanged.notify_all();
+				}
+			});
+		}
+
+		for (size_t i = 0; i < nFiles; ++i) {
+			{
+				std::unique_lock<std::mutex> lock(readMutex);
+				readChanged.wait(lock, [&]() { return readFiles[i].done; });
+			}
+
+			auto& file = readFiles[i];
+			for (const auto& block : file.blocks) {
+				dispatcher.enqueue(block, *file.data, file.owner, nullptr, BlockIndex::UNKNOWN_HEIGHT);
+			}
+
+			dispatcher.dispatch();
+
+			if (scanned != nullptr) scanned->insert(scanned->end(), file.index.entries.begin(), file.index.entries.end());
+			skipped += file.skipped;
+			accum += file.bytes;
+
+			std::cerr << "-- Parsed "
+				<< file.blocks.size() << (headerOnly ? " headers (" : " blocks (")
+				<< this->names[i] << ", "
+				<< this->sizes[i] / 1024 << " KiB, "
+				<< accum / 1024 / 1024 << " MiB total, "
+				<< "skipped " << file.skipped / 1024 << " KiB)"
+				<< std::endl;
+
+			{
+				std::lock_guard<std::mutex> lock(readMutex);
+				file = ReadFile();
+				++nextDispatch;
+			}
+			readChanged.notify_all();
+		}
+
+		for (auto& reader : readers) reader.join();
+	}
+
+	// reads only the selected index entries, in order, with the kernel prefetching ahead
+	// if headerOnly, only the headers are read, in batches to buffers of their own
+	// otherwise each block is read to the next of a ring of slots, which must outlive the workers
+	// returns the bytes read
+	template <typename D>
+	size_t readSelected (D& dispatcher, const std::vector<std::pair<uint32_t, const IndexEntry*>>& selected, const bool headerOnly, const std::vector<std::unique_ptr<BufferSlot>>& slots, const size_t slotLimit) const {
+		// the last selected entry of each file, after which it is closed
+		std::vector<size_t> lastSelected(this->names.size(), 0);
+		for (size_t j = 0; j < selected.size(); ++j) {
+			lastSelected[selected[j].second->file] = j;
+		}
+
+		std::vector<std::unique_ptr<OpenFile>> openFiles(this->names.size());
+		const auto opened = [&](const size_t i) -> const auto& {
+			if (not openFiles[i]) openFiles[i].reset(new OpenFile(this->names[i]));
+			return *openFiles[i];
+		};
+
+		size_t consumedBytes = 0;
+
+		if (headerOnly) {
+			const size_t BATCH_HEADERS = 4096;
+			for (size_t j = 0; j < selected.size(); j += BATCH_HEADERS) {
+				const auto n = std::min(BATCH_HEADERS, selected.size() - j);
+				const auto headers = std::make_shared<std::vector<uint8_t>>(n * 80);
+				const auto buffer = ptr_range(*headers);
+
+				for (size_t k = 0; k < n; ++k) {
+					const auto& e = *selected[j + k].second;
+					const auto header = buffer.drop(k * 80).take(80);
+
+					preadExact(opened(e.file).fd, header.begin(), e.offset, 80, this->key);
+					if (lastSelected[e.file] == j + k) openFiles[e.file].reset();
+
+					dispatcher.enqueue(Block(header, header.drop(80), e.hash), buffer, headers, nullptr, selected[j + k].first);
+				}
+
+				dispatcher.dispatch();
+				consumedBytes += headers->size();
+			}
+
+			return consumedBytes;
+		}
+
+		// prefetch up to PREFETCH_BYTES ahead, coalescing nearby blocks into a single request
+		const size_t PREFETCH_BYTES = 64 * 1024 * 1024;
+		const size_t COALESCE_GAP = 256 * 1024;
+		size_t prefetched = 0;
+		size_t prefetchedBytes = 0;
+
+		const auto prefetch = [&]() {
+			while ((prefetched < selected.size()) && (prefetchedBytes < consumedBytes + PREFETCH_BYTES)) {
+				const auto& first = *selected[prefetched].second;
+				auto end = static_cast<size_t>(first.offset) + first.length;
+				prefetchedBytes += first.length;
+				++prefetched;
+
+				while (prefetched < selected.size()) {
+					const auto& next = *selected[prefetched].second;
+					if (next.file != first.file) break;
+					if ((next.offset < first.offset) || (next.offset > end + COALESCE_GAP)) break;
+
+					end = std::max(end, static_cast<size_t>(next.offset) + next.length);
+					prefetchedBytes += next.length;
+					++prefetched;
+				}
+
+				opened(first.file).prefetch(first.offset, end - first.offset);
+			}
+		};
+
+		// each block is de-obfuscated in its slot, a slot is reused once its blocks are processed
+		size_t s = 0;
+		size_t used = 0;
+		for (size_t j = 0; j < selected.size(); ++j) {
+			prefetch();
+
+			const auto& e = *selected[j].second;
+			auto slot = slots[s % slots.size()].get();
+
+			// wait only for the workers still holding blocks from the next slot
+			if (used + e.length > slot->buffer.size()) {
+				dispatcher.dispatch();
+				if (used > 0) slot = slots[++s % slots.size()].get();
+				used = 0;
+
+				slot->wait();
+				slot->reserve(e.length, slotLimit);
+			}
+
+			const auto buffer = ptr_range(slot->buffer);
+			const auto r = buffer.drop(used).take(e.length);
+			preadExact(opened(e.file).fd, r.begin(), e.offset, e.length, this->key);
+			if (lastSelected[e.file] == j) openFiles[e.file].reset();
+
+			dispatcher.enqueue(Block(r.take(80), r.drop(80), e.hash), buffer, nullptr, slot, selected[j].first);
+			used += e.length;
+			consumedBytes += e.length;
+		}
+
+		dispatcher.dispatch();
+		return consumedBytes;
+	}
+};
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+// anonymous memory, backed by 2 MiB huge pages where the kernel allows it
+// explicit huge pages (MAP_HUGETLB) are tried first, then transparent huge pages (MADV_HUGEPAGE)
+struct PageBuffer {
+	static constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+private:
+	uint8_t* _data = nullptr;
+	size_t _size = 0;
+	bool _hugetlb = false;
+	bool _transparent = false;
+
+	void release () {
+		if (this->_data != nullptr) munmap(this->_data, this->_size);
+
+		this->_data = nullptr;
+		this->_size = 0;
+		this->_hugetlb = false;
+		this->_transparent = false;
+	}
+
+public:
+	PageBuffer () {}
+	PageBuffer (const size_t size) {
+		this->reserve(size);
+	}
+
+	PageBuffer (const PageBuffer&) = delete;
+	PageBuffer& operator= (const PageBuffer&) = delete;
+
+	~PageBuffer () {
+		this->release();
+	}
+
+	// ensures at least size bytes, the contents are discarded if it grows
+	void reserve (size_t size) {
+		if (size <= this->_size) return;
+
+		// buffers smaller than a huge page aren't worth one
+		static const auto pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+		const auto alignment = (size >= HUGE_PAGE_SIZE) ? HUGE_PAGE_SIZE : pageSize;
+		size = (size + alignment - 1) / alignment * alignment;
+
+		this->release();
+
+		auto mapping = MAP_FAILED;
+#ifdef MAP_HUGETLB
+		if (alignment == HUGE_PAGE_SIZE) {
+			mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			this->_hugetlb = mapping != MAP_FAILED;
+		}
+#endif
+
+		if (mapping == MAP_FAILED) {
+			mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			assert(mapping != MAP_FAILED);
+
+#ifdef MADV_HUGEPAGE
+			if (alignment == HUGE_PAGE_SIZE) this->_transparent = madvise(mapping, size, MADV_HUGEPAGE) == 0;
+#endif
+		}
+
+		this->_data = static_cast<uint8_t*>(mapping);
+		this->_size = size;
+	}
+
+	auto data () const { return this->_data; }
+	auto size () const { return this->_size; }
+	auto begin () const { return this->_data; }
+	auto end () const { return this->_data + this->_size; }
+
+	// "hugetlb", "transparent" or "none"
+	auto backing () const {
+		if (this->_hugetlb) return "hugetlb";
+		if (this->_transparent) return "transparent";
+		return "none";
+	}
+};
+
+// a buffer that may only be recycled once every reference to it is released
+struct BufferSlot {
+private:
+	std::atomic_size_t references;
+	std::mutex mutex;
+	std::condition_variable released;
+
+public:
+	PageBuffer buffer;
+
+	// grown in place of a stall, if a block won't fit
+	size_t grown = 0;
+
+	BufferSlot (const size_t size) : references(0), buffer(size) {}
+
+	void acquire () {
+		++this->references;
+	}
+
+	void release () {
+		if (--this->references > 0) return;
+
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->released.notify_all();
+	}
+
+	// blocks until all references are released
+	void wait () {
+		std::unique_lock<std::mutex> lock(this->mutex);
+		this->released.wait(lock, [&]() {
+			return this->references == 0;
+		});
+	}
+
+	// ensures room for size bytes, growing by at least double, up to limit
+	// only call once every reference is released, the contents are discarded
+	void reserve (const size_t size, const size_t limit) {
+		if (size <= this->buffer.size()) return;
+		assert(size <= limit);
+		assert(this->references == 0);
+
+		this->buffer.reserve(std::min(limit, std::max(size, 2 * this->buffer.size())));
+		++this->grown;
+	}
+};
@@ -111,7 +111,7 @@ struct dumpIndexdLevel : public TransformBase<Block> {
 		if (this->ldb != nullptr) delete this->ldb;
 	}
 
-	bool initialize (const char* arg) {
+	bool initialize (const char* arg) override {
 		if (TransformBase<Block>::initialize(arg)) return true;
 		if (strncmp(arg, "-l", 2) == 0) {
 			const auto folderName = std::string(arg + 2);
@@ -152,10 +152,13 @@ struct dumpIndexdLevel : public TransformBase<Block> {
 			putTip(batch, blockHash);
 		}
 
+		const auto txHashes = block.transactionHashes();
+		size_t txIndex = 0;
+
 		auto transactions = block.transactions();
 		while (not transactions.empty()) {
 			const auto& transaction = transactions.front();
-			const auto txHash = transaction.hash();
+			const auto& txHash = txHashes[txIndex++];
 
 			putTx(batch, txHash, height);
 
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define OBFUSCATION_X86
+#endif
+
+namespace {
+	typedef uint64_t xor_u64x4 __attribute__((vector_size(32)));
+
+	__attribute__((always_inline))
+	inline void xorPatternLanes (uint8_t* data, const size_t size, const uint64_t pattern) {
+		const xor_u64x4 patterns = { pattern, pattern, pattern, pattern };
+
+		size_t i = 0;
+		for (; i + 128 <= size; i += 128) {
+			xor_u64x4 a, b, c, d;
+			memcpy(&a, data + i, 32);
+			memcpy(&b, data + i + 32, 32);
+			memcpy(&c, data + i + 64, 32);
+			memcpy(&d, data + i + 96, 32);
+			a ^= patterns;
+			b ^= patterns;
+			c ^= patterns;
+			d ^= patterns;
+			memcpy(data + i, &a, 32);
+			memcpy(data + i + 32, &b, 32);
+			memcpy(data + i + 64, &c, 32);
+			memcpy(data + i + 96, &d, 32);
+		}
+
+		for (; i + 8 <= size; i += 8) {
+			uint64_t x;
+			memcpy(&x, data + i, 8);
+			x ^= pattern;
+			memcpy(data + i, &x, 8);
+		}
+
+		uint8_t bytes[8];
+		memcpy(bytes, &pattern, 8);
+		for (; i < size; ++i) {
+			data[i] ^= bytes[i % 8];
+		}
+	}
+
+	void xorPatternPortable (uint8_t* data, const size_t size, const uint64_t pattern) {
+		xorPatternLanes(data, size, pattern);
+	}
+
+#ifdef OBFUSCATION_X86
+	__attribute__((target("avx2")))
+	void xorPatternAVX2 (uint8_t* data, const size_t size, const uint64_t pattern) {
+		xorPatternLanes(data, size, pattern);
+	}
+#endif
+}
+
+// bitcoind may XOR the blk*.dat files with an 8 byte key (see xor.dat in the blocks directory)
+// the key is applied by file offset, the byte at offset i is XOR'd with key[i % 8]
+struct XorKey {
+	std::array<uint8_t, 8> key = {};
+
+	auto empty () const {
+		for (const auto x : this->key) {
+			if (x != 0) return false;
+		}
+
+		return true;
+	}
+
+	// de-obfuscates size bytes of data, found at offset in the file
+	void apply (uint8_t* data, const size_t size, const size_t offset) const {
+		if (this->empty()) return;
+
+		// the key, rotated to start at data[0]
+		uint8_t rotated[8];
+		for (size_t i = 0; i < 8; ++i) {
+			rotated[i] = this->key[(offset + i) % 8];
+		}
+
+		uint64_t pattern;
+		memcpy(&pattern, rotated, 8);
+
+#ifdef OBFUSCATION_X86
+		static const auto hasAVX2 = __builtin_cpu_supports("avx2");
+		if (hasAVX2) return xorPatternAVX2(data, size, pattern);
+#endif
+		xorPatternPortable(data, size, pattern);
+	}
+};
+
+// returns the key in <directory>/xor.dat, or an empty key if there is none
+auto readXorKey (const std::string& directory) {
+	XorKey key;
+
+	const auto file = fopen((directory + "/xor.dat").c_str(), "rb");
+	if (file == nullptr) return key;
+
+	const auto read = fread(key.key.data(), key.key.size(), 1, file);
+	assert(read == 1);
+	fclose(file);
+
+	return key;
+}
+
+// parses a key from 16 hex characters
+auto parseXorKey (const char* hex) {
+	XorKey key;
+
+	for (size_t i = 0; i < key.key.size(); ++i) {
+		unsigned int x = 0;
+		const auto n = sscanf(hex + 2 * i, "%2x", &x);
+		assert(n == 1);
+
+		key.key[i] = static_cast<uint8_t>(x);
+	}
+
+	return key;
+}
@@ -1,146 +1,504 @@
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <cstdio>
 #include <cstring>
 #include <ctime>
-#include <functional>
 #include <iostream>
 #include <memory>
+#include <optional>
 
 #include "bitcoin.hpp"
 #include "hash.hpp"
 #include "ranger.hpp"
 #include "serial.hpp"
-#include "threadpool.hpp"
 using namespace ranger;
 
+#include "blockindex.hpp"
+#include "blocksdir.hpp"
+#include "buffers.hpp"
+#include "obfuscation.hpp"
+#include "scanner.hpp"
 #include "statistics.hpp"
+#include "taskqueue.hpp"
 // #include "leveldb.hpp"
 
 using backing_vector_t = std::vector<uint8_t>;
+using range_t = decltype(ptr_range(backing_vector_t()));
 using block_t = decltype(Block(ptr_range(backing_vector_t()), ptr_range(backing_vector_t())));
-using thread_function_t = std::function<void(void)>;
-using transform_function_t = std::function<void(block_t)>;
+
+// a batch of consecutive blocks from one buffer, processed by a single worker
+struct Task {
+	static constexpr size_t MAX_BLOCKS = 16;
+	static constexpr size_t MAX_BYTES = 256 * 1024;
+
+	struct Entry {
+		size_t offset;
+		size_t length;
+		uint256_t hash;
+		uint32_t height; // if known from the index, see TransformBase::setHeight
+	};
+
+	// the buffer is kept alive by owner (e.g a mapped file), or until slot is released
+	range_t data;
+	std::shared_ptr<const void> owner;
+	BufferSlot* slot = nullptr;
+	size_t sequence = 0;
+	size_t count = 0;
+	size_t bytes = 0;
+	std::array<Entry, MAX_BLOCKS> blocks;
+
+	Task (const range_t& data, const size_t sequence) : data(data), sequence(sequence) {}
+
+	// small blocks are batched, larger blocks are sent alone
+	auto fits (const block_t& block) const {
+		if (this->count == 0) return true;
+		if (this->count == MAX_BLOCKS) return false;
+		return this->bytes + 80 + block.data.size() <= MAX_BYTES;
+	}
+
+	void push (const block_t& block, const uint32_t height) {
+		const auto offset = static_cast<size_t>(block.header.begin() - this->data.begin());
+		const auto length = 80 + block.data.size();
+
+		this->blocks[this->count++] = Entry{ offset, length, block.hash(), height };
+		this->bytes += length;
+	}
+
+	auto operator[] (const size_t i) const {
+		const auto& entry = this->blocks[i];
+		const auto r = this->data.drop(entry.offset).take(entry.length);
+		return Block(r.take(80), r.drop(80), entry.hash);
+	}
+};
+
+// a large block, processed in parts by any idle worker
+struct Split {
+	static constexpr size_t MIN_BYTES = 1024 * 1024;
+	static constexpr size_t PART_BYTES = 128 * 1024;
+
+	block_t block;
+	size_t sequence;
+	uint32_t height;
+	std::vector<block_t::Part> parts;
+	std::vector<std::vector<SinkBuffer>> outputs;
+	std::atomic_size_t remaining;
+
+	// the buffer holding the block
+	std::shared_ptr<const void> owner;
+	BufferSlot* slot;
+
+	Split (const block_t& block, const size_t sequence, const uint32_t height, const Task& task, const size_t nDelegates) :
+		block(block),
+		sequence(sequence),
+		height(height),
+		parts(block.split(PART_BYTES)),
+		outputs(nDelegates, std::vector<SinkBuffer>(this->parts.size())),
+		remaining(this->parts.size()),
+		owner(task.owner),
+		slot(task.slot) {
+		if (this->slot != nullptr) this->slot->acquire();
+	}
+};
+
+using part_t = std::pair<std::shared_ptr<Split>, size_t>;
+
+// batches consecutive blocks into tasks, each run through every transform on a pool of workers
+// the sequence of a block is its order in the input
+struct Dispatcher {
+	static constexpr uint32_t UNKNOWN_HEIGHT = BlockIndex::UNKNOWN_HEIGHT;
+
+private:
+	const std::vector<std::unique_ptr<TransformBase<block_t>>>& delegates;
+	const bool ordered;
+	const bool splitting;
+	std::optional<Task> task;
+	WorkerPool<Task, part_t> pool;
+
+	// every transform is run on the same block, on the same worker
+	void process (const block_t& block, const size_t sequence, const uint32_t height) {
+		TransformBase<block_t>::setHeight(height);
+
+		for (auto& delegate : this->delegates) {
+			delegate->operator()(block);
+			if (this->ordered) delegate->complete(sequence);
+		}
+
+		Arena::local().reset();
+	}
+
+	// each part is captured separately, the last part to finish gathers the output of the block
+	// transforms that can't be split are run on the whole block with the first part
+	void processPart (const part_t& part) {
+		auto& split = *part.first;
+		const auto i = part.second;
+
+		TransformBase<block_t>::setHeight(split.height);
+		for (size_t k = 0; k < this->delegates.size(); ++k) {
+			auto& delegate = this->delegates[k];
+
+			OutputSink::redirect(&split.outputs[k][i]);
+			if (delegate->splittable()) delegate->operator()(split.block, split.parts[i]);
+			else if (i == 0) delegate->operator()(split.block);
+		}
+
+		OutputSink::redirect(nullptr);
+		Arena::local().reset();
+
+		if (--split.remaining > 0) return;
+
+		for (size_t k = 0; k < this->delegates.size(); ++k) {
+			auto& delegate = this->delegates[k];
+
+			delegate->gather(split.outputs[k]);
+			if (this->ordered) delegate->complete(split.sequence);
+		}
+
+		if (split.slot != nullptr) split.slot->release();
+	}
+
+	// large blocks are split into parts, pushed to the worker's own deque, where idle workers may steal them
+	void processTask (const Task& task, WorkDeque<part_t>& deque) {
+		for (size_t j = 0; j < task.count; ++j) {
+			const auto block = task[j];
+			const auto sequence = task.sequence + j;
+			const auto height = task.blocks[j].height;
+
+			if (not this->splitting || (block.data.size() < Split::MIN_BYTES)) {
+				this->process(block, sequence, height);
+				continue;
+			}
+
+			const auto split = std::make_shared<Split>(block, sequence, height, task, this->delegates.size());
+			for (size_t k = split->parts.size() - 1; k > 0; --k) {
+				deque.push(part_t{split, k});
+			}
+
+			// help, rather than wait for, any thieves
+			this->processPart(part_t{split, 0});
+			while (const auto part = deque.pop()) this->processPart(*part);
+		}
+
+		if (task.slot != nullptr) task.slot->release();
+	}
+
+public:
+	size_t count = 0;
+
+	// large blocks are split into parts of transactions, but only if a transform can use them
+	// the queue is bounded, the reader waits for the workers if it gets too far ahead
+	Dispatcher (const std::vector<std::unique_ptr<TransformBase<block_t>>>& delegates, const size_t nThreads, const bool ordered) :
+		delegates(delegates),
+		ordered(ordered),
+		splitting((nThreads > 1) && std::any_of(delegates.begin(), delegates.end(), [](const auto& delegate) {
+			return delegate->splittable();
+		})),
+		pool(nThreads, 256, [this](const Task& task, WorkDeque<part_t>& deque) {
+			this->processTask(task, deque);
+		}, [this](const part_t& part) {
+			this->processPart(part);
+		}) {}
+
+	// dispatches the batched blocks, when full or at the end of a buffer
+	void dispatch () {
+		if (not this->task) return;
+		if (this->task->slot != nullptr) this->task->slot->acquire();
+
+		this->pool.push(*this->task);
+		this->task.reset();
+	}
+
+	// height is that of the block in the best chain, if known from the index
+	void enqueue (const block_t& block, const range_t& buffer, const std::shared_ptr<const void>& owner, BufferSlot* slot, const uint32_t height) {
+		if (this->task && (this->task->data.begin() != buffer.begin())) this->dispatch();
+		if (this->task && not this->task->fits(block)) this->dispatch();
+		if (not this->task) {
+			this->task.emplace(buffer, this->count);
+			this->task->owner = owner;
+			this->task->slot = slot;
+		}
+
+		this->task->push(block, height);
+		this->count++;
+	}
+
+	// waits for the workers to finish every task
+	void join () {
+		this->dispatch();
+		this->pool.join();
+	}
+};
+
+auto makeTransform (const size_t transformIndex) {
+	std::unique_ptr<TransformBase<block_t>> delegate;
+
+	// raw
+	if (transformIndex == 0) delegate.reset(new dumpHeaders<block_t>());
+	else if (transformIndex == 1) delegate.reset(new dumpScripts<block_t>());
+
+	// statistics
+	else if (transformIndex == 2) delegate.reset(new dumpStatistics<block_t>());
+	else if (transformIndex == 3) delegate.reset(new dumpOutputValuesOverHeight<block_t>());
+	else if (transformIndex == 4) delegate.reset(new dumpUnspents<block_t>());
+	else if (transformIndex == 5) delegate.reset(new dumpASM<block_t>());
+
+	// indexd
+// 	else if (transformIndex == 4) delegate.reset(new dumpLeveldb<block_t>());
+
+	assert(delegate != nullptr);
+	return delegate;
+}
 
 int main (int argc, char** argv) {
 	size_t memoryAlloc = 200 * 1024 * 1024;
 	size_t nThreads = 1;
+	size_t nReaders = 1;
+	size_t reorderLimit = 0;
+	std::string blocksDirectory;
+	std::string indexFileName;
+	std::optional<XorKey> xorKey;
+	size_t streamOffset = 0;
+	uint32_t fromHeight = 0;
+	uint32_t toHeight = 0xffffffff;
+	auto heightRange = false;
 
-	std::unique_ptr<TransformBase<block_t>> delegate;
+	std::vector<std::unique_ptr<TransformBase<block_t>>> delegates;
+	std::vector<const char*> delegateArgs;
+	size_t lastGroup = 0;
 
 	// parse command line arguments
 	for (auto i = 1; i < argc; ++i) {
 		const auto arg = argv[i];
-		size_t transformIndex = 0;
 
-		if (sscanf(arg, "-t%zu", &transformIndex) == 1) {
-			assert(delegate == nullptr);
+		// -t<INDEX>[,<INDEX>...], may be repeated
+		if (strncmp(arg, "-t", 2) == 0) {
+			lastGroup = delegates.size();
 
-			// raw
-			if (transformIndex == 0) delegate.reset(new dumpHeaders<block_t>());
-			else if (transformIndex == 1) delegate.reset(new dumpScripts<block_t>());
+			auto p = arg + 2;
+			while (true) {
+				char* next = nullptr;
+				const auto transformIndex = static_cast<size_t>(strtoul(p, &next, 10));
+				assert(next != p);
 
-			// statistics
-			else if (transformIndex == 2) delegate.reset(new dumpStatistics<block_t>());
-			else if (transformIndex == 3) delegate.reset(new dumpOutputValuesOverHeight<block_t>());
-			else if (transformIndex == 4) delegate.reset(new dumpUnspents<block_t>());
-			else if (transformIndex == 5) delegate.reset(new dumpASM<block_t>());
+				delegates.emplace_back(makeTransform(transformIndex));
+				if (*next == '\0') break;
+
+				assert(*next == ',');
+				p = next + 1;
+			}
+
+			continue;
+		}
 
-			// indexd
-// 			else if (transformIndex == 4) delegate.reset(new dumpLeveldb<block_t>());
+		// -o<FILENAME>, output for the transform of the preceding -t
+		if (strncmp(arg, "-o", 2) == 0) {
+			assert(delegates.size() == lastGroup + 1);
 
+			delegates.back()->setOutput(std::string(arg + 2));
 			continue;
 		}
+
 		if (sscanf(arg, "-j%zu", &nThreads) == 1) continue;
+		if (sscanf(arg, "-p%zu", &nReaders) == 1) continue;
 		if (sscanf(arg, "-m%zu", &memoryAlloc) == 1) continue;
 
-		if (delegate && delegate->initialize(arg)) continue;
+		// -r[<BYTES>], ordered output
+		if (strcmp(arg, "-r") == 0) {
+			reorderLimit = 64 * 1024 * 1024;
+			continue;
+		}
+		if (sscanf(arg, "-r%zu", &reorderLimit) == 1) continue;
+
+		if (strncmp(arg, "-d", 2) == 0) {
+			blocksDirectory = std::string(arg + 2);
+			continue;
+		}
+
+		// -i<FILENAME>, block index for -d
+		if (strncmp(arg, "-i", 2) == 0) {
+			indexFileName = std::string(arg + 2);
+			continue;
+		}
+
+		// -x<HEXKEY>[:<OFFSET>], obfuscation key, and the offset of stdin within the blk*.dat file
+		// stdin must be a single file, as the key phase restarts at each file (finalized files are truncated to any size)
+		if (strncmp(arg, "-x", 2) == 0) {
+			assert(strlen(arg) >= 18);
+			xorKey = parseXorKey(arg + 2);
+
+			if (arg[18] == ':') {
+				const auto n = sscanf(arg + 19, "%zu", &streamOffset);
+				assert(n == 1);
+			} else {
+				assert(arg[18] == '\0');
+			}
+
+			continue;
+		}
+
+		// --heights=<FROM>[:<TO>], [FROM, TO)
+		if (strncmp(arg, "--heights=", 10) == 0) {
+			const auto n = sscanf(arg, "--heights=%u:%u", &fromHeight, &toHeight);
+			assert(n >= 1);
+			assert(fromHeight < toHeight);
+
+			heightRange = true;
+			continue;
+		}
+
+		delegateArgs.emplace_back(arg);
+	}
+
+	assert(not delegates.empty());
+	assert(nReaders > 0);
+	assert(indexFileName.empty() || not blocksDirectory.empty());
+	assert(not heightRange || not indexFileName.empty());
+
+	// any remaining arguments are for the transforms (e.g -w)
+	for (const auto arg : delegateArgs) {
+		auto used = false;
+		for (auto& delegate : delegates) {
+			used |= delegate->initialize(arg);
+		}
+
+		assert(used);
+	}
+
+	// with -w, output is only in height order if blocks are read in height order, from an index
+	const auto ordered = reorderLimit > 0;
+	const auto requireSelective = [&](const bool selective) {
+		if (not ordered || selective || not delegates.front()->whitelisting()) return;
+
+		std::cerr << "-r with -w requires -d and an index (-i), so blocks are read in height order" << std::endl;
 		assert(false);
+	};
+
+	if (ordered) {
+		for (auto& delegate : delegates) {
+			delegate->setOrdered(reorderLimit);
+		}
+
+		std::cerr << "Ordering output (reorder buffer limit " << reorderLimit / 1024 << " KiB)" << std::endl;
 	}
 
 	time_t start, end;
 	time(&start);
 
-	// pre-allocate buffers
-	const auto halfMemoryAlloc = memoryAlloc / 2;
-	backing_vector_t iobuffer(halfMemoryAlloc);
-	backing_vector_t parsebuffer(halfMemoryAlloc);
-	std::cerr << "Allocated IO buffer (" << halfMemoryAlloc << " bytes)" << std::endl;
-	std::cerr << "Allocated parse buffer (" << halfMemoryAlloc << " bytes)" << std::endl;
+	// pre-allocate a ring of buffer slots, for blocks read from stdin or selected from the index
+	// a slot grows if a block won't fit, up to slotLimit (far beyond any valid block)
+	const auto nSlots = std::max(size_t(2), std::min(size_t(4), nThreads + 1));
+	const auto slotLimit = std::max(memoryAlloc / nSlots, size_t(64 * 1024 * 1024));
+	std::vector<std::unique_ptr<BufferSlot>> slots;
+	const auto allocateSlots = [&](const size_t size) {
+		for (size_t i = 0; i < nSlots; ++i) {
+			slots.emplace_back(new BufferSlot(size));
+		}
 
-	ThreadPool<thread_function_t> pool(nThreads);
-	std::cerr << "Initialized " << nThreads << " threads in the thread pool" << std::endl;
+		std::cerr << "Allocated " << nSlots << " buffer slots ("
+			<< slots.front()->buffer.size() << " bytes each, "
+			<< "huge pages " << slots.front()->buffer.backing() << ")"
+			<< std::endl;
+	};
+
+	Dispatcher dispatcher(delegates, nThreads, ordered);
+	std::cerr << "Initialized " << nThreads << " worker threads" << std::endl;
 
-	size_t count = 0;
-	size_t remainder = 0;
 	size_t accum = 0;
-	size_t invalid = 0;
-
-	while (true) {
-		const auto available = iobuffer.size() - remainder;
-		const auto read = std::fread(iobuffer.data() + remainder, 1, available, stdin);
-		const auto eof = static_cast<size_t>(read) < available;
-		accum += read;
-
-		// wait for all workers before overwrite
-		pool.wait();
-
-		// copy [all of] iobuffer to parsebuffer, releasing iobuffer for the next read
-		std::copy(iobuffer.cbegin(), iobuffer.cend(), parsebuffer.begin());
-
-		auto data = ptr_range(parsebuffer).take(remainder + read);
-		std::cerr << "-- Parsed "
-			<< count << " blocks ("
-			<< "read " << read / 1024 << " KiB, "
-			<< accum / 1024 / 1024 << " MiB total, "
-			<< "skipped " << invalid / 1024 << "KiB)"
-			<< (eof ? " EOF" : "")
-			<< std::endl;
+	size_t skipped = 0;
 
-		while (data.size() >= 88) {
-			// skip bad data (e.g bitcoind zero pre-allocations)
-			if (serial::peek<uint32_t>(data) != 0xd9b4bef9) {
-				data = data.drop(1);
-				continue;
-			}
+	// read each blk*.dat file, or only the blocks selected from the index
+	if (not blocksDirectory.empty()) {
+		BlockFiles files(blocksDirectory);
+		std::cerr << "Found " << files.names.size() << " block files in " << blocksDirectory << std::endl;
 
-			// skip bad data cont.
-			const auto header = data.drop(8).take(80);
-			if (not Block(header, header.drop(80)).verify()) {
-				data = data.drop(1);
-				++invalid;
-				continue;
-			}
+		// xor.dat, unless given with -x
+		files.key = xorKey ? *xorKey : readXorKey(blocksDirectory);
+		if (not files.key.empty()) std::cerr << "Found obfuscation key " << toHex(files.key.key) << std::endl;
+
+		// with an index, blocks are taken from their known locations without scanning
+		// only files changed since the index was written are scanned, then the index is rewritten
+		BlockIndex index;
+		auto stale = std::vector<bool>(files.names.size(), true);
+		if (not indexFileName.empty()) stale = index.load(indexFileName, files.sizes, files.modified);
+		const auto anyStale = std::find(stale.begin(), stale.end(), true) != stale.end();
+
+		// if no transform needs more than the header, the transactions are never read
+		const auto headerOnly = std::all_of(delegates.begin(), delegates.end(), [](const auto& delegate) {
+			return delegate->headerOnly();
+		});
 
-			// do we have enough data?
-			const auto length = serial::peek<uint32_t>(data.drop(4));
-			const auto total = 8 + length;
-			if (total > data.size()) break;
-			data = data.drop(8);
+		// with -w or --heights, the index tells us which blocks are wanted
+		// read only those, in height order, with the kernel prefetching ahead
+		const auto selective = not indexFileName.empty() && (heightRange || delegates.front()->whitelisting());
+		requireSelective(selective);
 
-			// send the block data to the threadpool
-			const auto block = Block(header, data.drop(80));
-			pool.push([block, &delegate]() {
-				delegate->operator()(block);
+		if (selective) {
+			// the heights are only known once every file is indexed, so changed files are indexed first
+			if (anyStale) {
+				files.update(index, stale, skipped);
+				index.save(indexFileName);
+			}
+
+			const auto& front = delegates.front();
+			const auto selected = index.select(fromHeight, toHeight, [&](const IndexEntry& e) -> std::optional<uint32_t> {
+				if (not front->whitelisting()) return e.height;
+				return front->whitelisted(e.hash);
 			});
 
-			count++;
+			// blocks are read one at a time, so a slot only needs room for a few tasks
+			if (not headerOnly) allocateSlots(std::min(memoryAlloc / nSlots, size_t(4 * 1024 * 1024)));
+
+			accum = files.readSelected(dispatcher, selected, headerOnly, slots, slotLimit);
+			std::cerr << "-- Read "
+				<< selected.size() << " of " << index.entries.size() << " blocks ("
+				<< accum / 1024 << " KiB)"
+				<< std::endl;
+
+			dispatcher.join();
+		} else {
+			// the entries of scanned files, merged into the index once every reader is done with it
+			std::vector<IndexEntry> scanned;
 
-			data = data.drop(length);
+			files.read(dispatcher, index, stale, indexFileName.empty() ? nullptr : &scanned, headerOnly, nReaders, accum, skipped);
+			dispatcher.join();
+
+			if (not indexFileName.empty() && anyStale) {
+				index.merge(scanned);
+				index.computeHeights();
+				index.save(indexFileName);
+			}
 		}
+	} else {
+		requireSelective(false);
 
-		if (eof) break;
+		allocateSlots(memoryAlloc / nSlots);
+		readStream(dispatcher, stdin, slots, slotLimit, xorKey, streamOffset, accum, skipped);
 
-		// assign remainder to front of iobuffer (w/ next read offset by remainder)
-		std::copy(data.begin(), data.end(), iobuffer.begin());
-		remainder = data.size();
+		// wait for all workers before the slots are released
+		dispatcher.join();
+
+		size_t grown = 0;
+		size_t largest = 0;
+		for (const auto& slot : slots) {
+			grown += slot->grown;
+			largest = std::max(largest, slot->buffer.size());
+		}
+
+		std::cerr << "Buffer slots grew " << grown << " times ("
+			<< "largest " << largest / 1024 << " KiB)"
+			<< std::endl;
 	}
 
 	time(&end);
 	std::cerr << "Parsed "
-		<< count << " blocks ("
+		<< dispatcher.count << " blocks ("
 		<< accum / 1024 / 1024 << " MiB)"
 		<< " in " << difftime(end, start) << " seconds"
 		<< std::endl;
+	std::cerr << "Arenas made "
+		<< Arena::heapAllocations << " heap allocations ("
+		<< Arena::heapBytes / 1024 << " KiB)"
+		<< std::endl;
 
 	return 0;
 }
@@ -0,0 +1,271 @@
+#pragma once
+
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <vector>
+
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCANNER_X86
+#endif
+
+#include "bitcoin.hpp"
+#include "buffers.hpp"
+#include "obfuscation.hpp"
+#include "ranger.hpp"
+#include "serial.hpp"
+
+namespace {
+	constexpr uint32_t BLOCK_MAGIC = 0xd9b4bef9;
+
+	// returns the offset of the first magic number in [begin, end), or (end - begin) - 3 if none was found
+	auto findMagicPortable (const uint8_t* begin, const uint8_t* end) {
+		auto p = begin;
+
+		while (end - p >= 4) {
+			const auto candidate = static_cast<const uint8_t*>(memchr(p, 0xf9, static_cast<size_t>(end - p - 3)));
+			if (candidate == nullptr) break;
+			if ((candidate[1] == 0xbe) && (candidate[2] == 0xb4) && (candidate[3] == 0xd9)) return static_cast<size_t>(candidate - begin);
+			p = candidate + 1;
+		}
+
+		return static_cast<size_t>(end - begin) - 3;
+	}
+
+#ifdef SCANNER_X86
+	// compares 32 candidate offsets per iteration, one lane per magic byte
+	__attribute__((target("avx2")))
+	size_t findMagicAVX2 (const uint8_t* begin, const uint8_t* end) {
+		const auto m0 = _mm256_set1_epi8(static_cast<char>(0xf9));
+		const auto m1 = _mm256_set1_epi8(static_cast<char>(0xbe));
+		const auto m2 = _mm256_set1_epi8(static_cast<char>(0xb4));
+		const auto m3 = _mm256_set1_epi8(static_cast<char>(0xd9));
+		auto p = begin;
+
+		while (end - p >= 32 + 3) {
+			const auto v0 = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)), m0);
+			const auto v1 = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 1)), m1);
+			const auto v2 = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 2)), m2);
+			const auto v3 = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 3)), m3);
+			const auto mask = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_and_si256(_mm256_and_si256(v0, v1), _mm256_and_si256(v2, v3))));
+			if (mask != 0) return static_cast<size_t>(p - begin) + static_cast<size_t>(__builtin_ctz(mask));
+
+			p += 32;
+		}
+
+		return static_cast<size_t>(p - begin) + findMagicPortable(p, end);
+	}
+
+	// compares 16 candidate offsets per iteration (SSE2 is the x86-64 baseline)
+	size_t findMagicSSE2 (const uint8_t* begin, const uint8_t* end) {
+		const auto m0 = _mm_set1_epi8(static_cast<char>(0xf9));
+		const auto m1 = _mm_set1_epi8(static_cast<char>(0xbe));
+		const auto m2 = _mm_set1_epi8(static_cast<char>(0xb4));
+		const auto m3 = _mm_set1_epi8(static_cast<char>(0xd9));
+		auto p = begin;
+
+		while (end - p >= 16 + 3) {
+			const auto v0 = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)), m0);
+			const auto v1 = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 1)), m1);
+			const auto v2 = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 2)), m2);
+			const auto v3 = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 3)), m3);
+			const auto mask = static_cast<uint32_t>(_mm_movemask_epi8(_mm_and_si128(_mm_and_si128(v0, v1), _mm_and_si128(v2, v3))));
+			if (mask != 0) return static_cast<size_t>(p - begin) + static_cast<size_t>(__builtin_ctz(mask));
+
+			p += 16;
+		}
+
+		return static_cast<size_t>(p - begin) + findMagicPortable(p, end);
+	}
+#endif
+
+	// returns the offset of the next candidate magic number in data
+	template <typename R>
+	size_t findMagic (const R& data) {
+		if (data.size() < 4) return 0;
+
+		const uint8_t* begin = data.begin();
+		const uint8_t* end = data.end();
+
+#ifdef SCANNER_X86
+		static const auto hasAVX2 = __builtin_cpu_supports("avx2");
+		if (hasAVX2) return findMagicAVX2(begin, end);
+		return findMagicSSE2(begin, end);
+#else
+		return findMagicPortable(begin, end);
+#endif
+	}
+}
+
+// calls f(block) for every verified block in data, returning the unparsed remainder
+// skipped is incremented by the number of bytes discarded while resynchronizing
+template <typename R, typename F>
+auto scanBlocks (R data, size_t& skipped, F f) {
+	while (data.size() >= 88) {
+		// skip bad data (e.g bitcoind zero pre-allocations)
+		if (serial::peek<uint32_t>(data) != BLOCK_MAGIC) {
+			const auto offset = findMagic(data);
+			data = data.drop(offset);
+			skipped += offset;
+			continue;
+		}
+
+		// skip bad data cont.
+		const auto header = data.drop(8).take(80);
+		const auto candidate = Block(header, header.drop(80));
+		if (not candidate.verify()) {
+			data = data.drop(1);
+			++skipped;
+			continue;
+		}
+
+		// do we have enough data?
+		const auto length = serial::peek<uint32_t>(data.drop(4));
+		if (length < 80) {
+			data = data.drop(1);
+			++skipped;
+			continue;
+		}
+
+		const auto total = 8 + length;
+		if (total > data.size()) break;
+		data = data.drop(8);
+
+		// re-use the hash computed for verification
+		f(Block(header, data.take(length).drop(80), candidate.hash()));
+		data = data.drop(length);
+	}
+
+	return data;
+}
+
+// the size of the block record at the front of what scanBlocks returned, once complete
+template <typename R>
+size_t pendingBlockSize (const R& data) {
+	// too short for scanBlocks to have checked it
+	if (data.size() < 88) return 88;
+
+	return 8 + serial::peek<uint32_t>(data.drop(4));
+}
+
+// reads exactly n bytes at offset to data, de-obfuscated with key
+void preadExact (const int fd, uint8_t* data, const size_t offset, const size_t n, const XorKey& key) {
+	size_t done = 0;
+	while (done < n) {
+		const auto read = pread(fd, data + done, n - done, static_cast<off_t>(offset + done));
+		assert(read > 0);
+		done += static_cast<size_t>(read);
+	}
+
+	key.apply(data, n, offset);
+}
+
+// as preadExact, to the front of buffer
+template <typename R>
+auto preadRange (const int fd, R& buffer, const size_t offset, const size_t n, const XorKey& key) {
+	assert(n <= buffer.size());
+
+	preadExact(fd, buffer.data(), offset, n, key);
+	return ptr_range(buffer).take(n);
+}
+
+// as scanBlocks, but only reading the 88 bytes at each block boundary of a file, then seeking past the transactions
+// f is called with each header, its offset in the file, the length of its block and its hash
+template <typename F>
+void scanHeaders (const int fd, const size_t size, const XorKey& key, size_t& skipped, F f) {
+	std::array<uint8_t, 64 * 1024> buffer;
+	size_t offset = 0;
+
+	while (offset + 88 <= size) {
+		const auto data = preadRange(fd, buffer, offset, 88, key);
+
+		// skip bad data, searching a larger window for the next magic number
+		if (serial::peek<uint32_t>(data) != BLOCK_MAGIC) {
+			const auto window = preadRange(fd, buffer, offset, std::min(buffer.size(), size - offset), key);
+			const auto skip = findMagic(window);
+			offset += skip;
+			skipped += skip;
+			continue;
+		}
+
+		const auto header = data.drop(8).take(80);
+		const auto candidate = Block(header, header.drop(80));
+		const auto length = serial::peek<uint32_t>(data.drop(4));
+		if (not candidate.verify() || (length < 80)) {
+			++offset;
+			++skipped;
+			continue;
+		}
+
+		if (offset + 8 + length > size) break;
+
+		f(header, offset + 8, length, candidate.hash());
+		offset += 8 + length;
+	}
+}
+
+// reads the blocks of a stream to a ring of buffer slots, each held until its blocks are processed
+// a slot grows if a block won't fit, up to slotLimit (far beyond any valid block), the slots must outlive the workers
+// with a key, the stream is de-obfuscated from streamOffset, its offset within a single blk*.dat file
+template <typename D>
+void readStream (D& dispatcher, FILE* stream, const std::vector<std::unique_ptr<BufferSlot>>& slots, const size_t slotLimit, const std::optional<XorKey>& key, size_t streamOffset, size_t& accum, size_t& skipped) {
+	const auto nSlots = slots.size();
+	auto data = ptr_range(slots.front()->buffer).take(0);
+	size_t needed = 0;
+
+	for (size_t i = 0; ; ++i) {
+		const auto slot = slots[i % nSlots].get();
+
+		// wait only for the workers still holding blocks from this slot
+		slot->wait();
+		slot->reserve(needed, slotLimit);
+
+		// assign remainder to front of the slot (w/ next read offset by remainder)
+		const auto remainder = data.size();
+		std::copy(data.begin(), data.end(), slot->buffer.begin());
+
+		const auto available = slot->buffer.size() - remainder;
+		const auto read = std::fread(slot->buffer.data() + remainder, 1, available, stream);
+		const auto eof = static_cast<size_t>(read) < available;
+		accum += read;
+
+		// the offset within the one file on the stream, the key phase of concatenated files is unknown
+		if (key) key->apply(slot->buffer.data() + remainder, read, streamOffset);
+		streamOffset += read;
+
+		data = ptr_range(slot->buffer).take(remainder + read);
+		std::cerr << "-- Parsed "
+			<< dispatcher.count << " blocks ("
+			<< "read " << read / 1024 << " KiB, "
+			<< accum / 1024 / 1024 << " MiB total, "
+			<< "skipped " << skipped / 1024 << " KiB)"
+			<< (eof ? " EOF" : "")
+			<< std::endl;
+
+		// send the block data to the workers, holding the slot until processed
+		data = scanBlocks(data, skipped, [&](const auto& block) {
+			dispatcher.enqueue(block, ptr_range(slot->buffer), nullptr, slot, D::UNKNOWN_HEIGHT);
+		});
+
+		dispatcher.dispatch();
+
+		if (eof) break;
+
+		// skip over a block that could never fit, as for any bad data
+		needed = pendingBlockSize(data);
+		if (needed > slotLimit) {
+			std::cerr << "Block of " << needed << " bytes exceeds the buffer limit, skipped" << std::endl;
+			data = data.drop(1);
+			++skipped;
+			needed = 0;
+		}
+	}
+}
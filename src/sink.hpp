@@ -0,0 +1,226 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "ranger.hpp"
+using namespace ranger;
+
+// records buffered by a single thread, only ever flushed between blocks
+struct SinkBuffer {
+	std::vector<uint8_t> data;
+
+	template <typename R>
+	void put (const R& r) {
+		this->data.insert(this->data.end(), r.begin(), r.end());
+	}
+
+	// returns n writable bytes at the end of the buffer, unused bytes are returned with trim()
+	auto prepare (const size_t n) {
+		const auto size = this->data.size();
+		this->data.resize(size + n);
+		return ptr_range(this->data).drop(size);
+	}
+
+	void trim (const size_t n) {
+		this->data.resize(this->data.size() - n);
+	}
+};
+
+// an output file shared by every worker, each with its own buffer
+// buffers are written with a single write(2) per flush, so the records of a block are never interleaved
+// if ordered, the output of each block is held in a reorder buffer until every preceding key is complete
+struct OutputSink {
+private:
+	static constexpr size_t CAPACITY = 2 * 1024 * 1024;
+	static inline std::atomic_size_t nextId = 0;
+
+	int _fd = STDOUT_FILENO;
+	size_t _id = nextId++;
+	std::mutex _mutex;
+	std::vector<std::unique_ptr<SinkBuffer>> _buffers;
+
+	// reorder buffer
+	bool _ordered = false;
+	size_t _next = 0;
+	size_t _limit = 0;
+	size_t _reorderBytes = 0;
+	std::map<size_t, std::vector<uint8_t>> _reorder;
+	std::vector<uint8_t> _staged;
+	std::condition_variable _advanced;
+
+	void writeAll (const uint8_t* data, size_t size) {
+		while (size > 0) {
+			const auto written = ::write(this->_fd, data, size);
+			if ((written == -1) && (errno == EINTR)) continue;
+			assert(written > 0);
+
+			data += written;
+			size -= static_cast<size_t>(written);
+		}
+	}
+
+public:
+	OutputSink () {}
+	OutputSink (const OutputSink&) = delete;
+	OutputSink& operator= (const OutputSink&) = delete;
+
+	~OutputSink () {
+		this->drain();
+
+		for (auto& buffer : this->_buffers) {
+			this->flush(*buffer);
+		}
+
+		if (this->_fd != STDOUT_FILENO) close(this->_fd);
+	}
+
+	void open (const std::string& fileName) {
+		assert(this->_fd == STDOUT_FILENO);
+		this->_fd = ::open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		assert(this->_fd != -1);
+	}
+
+	// until reset, local() returns buffer for every sink on the calling thread
+	// used to capture the output of part of a block, see TransformBase::gather
+	static void redirect (SinkBuffer* buffer) {
+		OutputSink::redirected() = buffer;
+	}
+
+	// the calling thread's buffer for this sink
+	SinkBuffer& local () {
+		if (const auto buffer = OutputSink::redirected()) return *buffer;
+
+		thread_local std::vector<std::pair<size_t, SinkBuffer*>> buffers;
+
+		for (const auto& pair : buffers) {
+			if (pair.first == this->_id) return *pair.second;
+		}
+
+		std::lock_guard<std::mutex> lock(this->_mutex);
+		this->_buffers.emplace_back(new SinkBuffer());
+
+		const auto buffer = this->_buffers.back().get();
+		buffer->data.reserve(CAPACITY);
+		buffers.emplace_back(this->_id, buffer);
+		return *buffer;
+	}
+
+	// emit the output of each block in order of its key, starting from 0
+	// every key must be completed, and workers wait while the reorder buffer exceeds limit bytes
+	void order (const size_t limit) {
+		this->_ordered = true;
+		this->_limit = limit;
+	}
+
+	// marks the end of a block, flushing the buffer if it is near capacity
+	void commit (SinkBuffer& buffer) {
+		if (this->_ordered) return;
+		if (&buffer == OutputSink::redirected()) return;
+		if (buffer.data.size() < CAPACITY) return;
+		this->flush(buffer);
+	}
+
+	// hands the calling thread's output for the block at key to the reorder buffer
+	void complete (const size_t key) {
+		auto& buffer = this->local();
+
+		std::unique_lock<std::mutex> lock(this->_mutex);
+		assert(key >= this->_next);
+
+		this->_reorderBytes += buffer.data.size();
+		auto& entry = this->_reorder[key];
+		if (entry.empty()) entry.swap(buffer.data);
+		else entry.insert(entry.end(), buffer.data.begin(), buffer.data.end());
+		buffer.data.clear();
+
+		this->advance();
+
+		// don't run too far ahead of the slowest worker
+		this->_advanced.wait(lock, [&]() {
+			return (this->_reorderBytes <= this->_limit) || (key < this->_next);
+		});
+
+		this->flushStaged(false);
+	}
+
+	void flush (SinkBuffer& buffer) {
+		if (buffer.data.empty()) return;
+
+		std::lock_guard<std::mutex> lock(this->_mutex);
+		this->writeAll(buffer.data.data(), buffer.data.size());
+		buffer.data.clear();
+	}
+
+	// writes immediately, bypassing any buffering
+	template <typename R>
+	void write (const R& r) {
+		this->drain();
+
+		std::lock_guard<std::mutex> lock(this->_mutex);
+		this->writeAll(reinterpret_cast<const uint8_t*>(r.data()), r.size());
+	}
+
+private:
+	static SinkBuffer*& redirected () {
+		thread_local SinkBuffer* buffer = nullptr;
+		return buffer;
+	}
+
+	void stage (const std::vector<uint8_t>& data) {
+		this->_staged.insert(this->_staged.end(), data.begin(), data.end());
+	}
+
+	void flushStaged (const bool force) {
+		if (this->_staged.empty()) return;
+		if (not force && this->_staged.size() < CAPACITY) return;
+
+		this->writeAll(this->_staged.data(), this->_staged.size());
+		this->_staged.clear();
+	}
+
+	// stages every completed key following _next
+	void advance () {
+		const auto before = this->_next;
+
+		while (not this->_reorder.empty()) {
+			const auto iter = this->_reorder.begin();
+			if (iter->first != this->_next) break;
+
+			this->stage(iter->second);
+			this->_reorderBytes -= iter->second.size();
+			this->_reorder.erase(iter);
+			++this->_next;
+		}
+
+		if (this->_next != before) this->_advanced.notify_all();
+	}
+
+	// writes whatever remains in the reorder buffer, in order
+	void drain () {
+		std::lock_guard<std::mutex> lock(this->_mutex);
+		if (not this->_reorder.empty()) {
+			std::cerr << "Reorder buffer incomplete, skipped keys from " << this->_next << std::endl;
+		}
+
+		for (auto& entry : this->_reorder) {
+			this->stage(entry.second);
+		}
+
+		this->_reorder.clear();
+		this->_reorderBytes = 0;
+		this->flushStaged(true);
+	}
+};
@@ -2,6 +2,7 @@
 
 #include <atomic>
 #include <mutex>
+#include <sstream>
 #include <vector>
 #include "transforms.hpp"
 using namespace ranger;
@@ -9,24 +10,37 @@ using namespace ranger;
 // HEIGHT | VALUE > stdout
 template <typename Block>
 struct dumpOutputValuesOverHeight : public TransformBase<Block> {
+	struct Visitor : public VisitorBase {
+		static constexpr bool OUTPUT = true;
+
+		SinkBuffer* sink;
+		std::array<uint8_t, 12> buffer;
+
+		template <typename O>
+		void output (const O& output) {
+			serial::place<uint64_t>(range(this->buffer).drop(4), output.value);
+			this->sink->put(this->buffer);
+		}
+	};
+
+	bool splittable () const { return true; }
+
 	void operator() (const Block& block) {
+		this->operator()(block, block.whole());
+	}
+
+	void operator() (const Block& block, const typename Block::Part& part) {
 		uint32_t height = 0xffffffff;
 		if (this->shouldSkip(block, nullptr, &height)) return;
 
-		std::array<uint8_t, 12> buffer;
-		serial::place<uint32_t>(buffer, height);
-
-		auto transactions = block.transactions();
-		while (not transactions.empty()) {
-			const auto& transaction = transactions.front();
+		auto& sink = this->output.local();
 
-			for (const auto& output : transaction.outputs) {
-				serial::place<uint64_t>(range(buffer).drop(4), output.value);
-				fwrite(buffer.begin(), buffer.size(), 1, stdout);
-			}
+		Visitor visitor;
+		visitor.sink = &sink;
+		serial::place<uint32_t>(visitor.buffer, height);
+		block.visit(visitor, part);
 
-			transactions.pop_front();
-		}
+		this->output.commit(sink);
 	}
 };
 
@@ -55,7 +69,8 @@ struct dumpStatistics : public TransformBase<Block> {
 	}
 
 	virtual ~dumpStatistics () {
-		std::cout <<
+		std::ostringstream ss;
+		ss <<
 			"Transactions:\t" << this->transactions << '\n' <<
 			"-- Inputs:\t" << this->inputs << " (ratio " << perc(this->inputs, this->transactions) << ") \n" <<
 			"-- Outputs:\t" << this->outputs << " (ratio " << perc(this->outputs, this->transactions) << ") \n" <<
@@ -64,108 +79,139 @@ struct dumpStatistics : public TransformBase<Block> {
 			"-- Locktimes (>0):\t" << this->locktimesGt0 << " (" << perc(this->locktimesGt0, this->transactions) * 100 << "%) \n" <<
 			"-- Sequences (!= FINAL):\t" << this->nonFinalSequences << " (" << perc(this->nonFinalSequences, this->inputs) * 100 << "%) \n" <<
 			std::endl;
-	}
 
-	void operator() (const Block& block) {
-		if (this->shouldSkip(block)) return;
+		this->output.write(ss.str());
+	}
 
-		auto transactions = block.transactions();
-		this->transactions += transactions.size();
+	struct Visitor : public VisitorBase {
+		static constexpr bool TRANSACTION = true;
+		static constexpr bool INPUT = true;
+
+		uint64_t inputs = 0;
+		uint64_t outputs = 0;
+		uint64_t transactions = 0;
+		uint64_t version1 = 0;
+		uint64_t version2 = 0;
+		uint64_t locktimesGt0 = 0;
+		uint64_t nonFinalSequences = 0;
+
+		template <typename I>
+		void input (const I& input) {
+			this->nonFinalSequences += input.sequence != 0xffffffff;
+		}
 
-		while (not transactions.empty()) {
-			const auto& transaction = transactions.front();
+		template <typename T>
+		void transaction (const T& transaction) {
+			this->transactions += 1;
+			this->inputs += transaction.nInputs;
+			this->outputs += transaction.nOutputs;
+			this->version1 += transaction.version == 1;
+			this->version2 += transaction.version == 2;
+			this->locktimesGt0 += transaction.locktime > 0;
+		}
+	};
 
-			this->inputs += transaction.inputs.size();
+	bool splittable () const { return true; }
 
-			size_t nfs = 0;
-			for (const auto& input : transaction.inputs) {
-				if (input.sequence != 0xffffffff) nfs++;
-			}
+	void operator() (const Block& block) {
+		this->operator()(block, block.whole());
+	}
 
-			this->nonFinalSequences += nfs;
-			this->outputs += transaction.outputs.size();
+	void operator() (const Block& block, const typename Block::Part& part) {
+		if (this->shouldSkip(block)) return;
 
-			this->version1 += transaction.version == 1;
-			this->version2 += transaction.version == 2;
-			this->locktimesGt0 += transaction.locktime > 0;
+		Visitor visitor;
+		block.visit(visitor, part);
 
-			transactions.pop_front();
-		}
+		this->inputs += visitor.inputs;
+		this->outputs += visitor.outputs;
+		this->transactions += visitor.transactions;
+		this->version1 += visitor.version1;
+		this->version2 += visitor.version2;
+		this->locktimesGt0 += visitor.locktimesGt0;
+		this->nonFinalSequences += visitor.nonFinalSequences;
 	}
 };
 
 // ASM > stdout
 template <typename Block>
 struct dumpASM : public TransformBase<Block> {
+	bool splittable () const { return true; }
+
 	void operator() (const Block& block) {
+		this->operator()(block, block.whole());
+	}
+
+	void operator() (const Block& block, const typename Block::Part& part) {
 		if (this->shouldSkip(block)) return;
 
-		std::array<uint8_t, 1024*1024> buffer;
+		auto& sink = this->output.local();
 
-		auto transactions = block.transactions();
+		auto transactions = block.transactions(part);
 		while (not transactions.empty()) {
 			const auto& transaction = transactions.front();
 
 			for (const auto& output : transaction.inputs) {
-				auto tmp = range(buffer);
+				// worst case, every byte is the longest opcode string, then "<ERROR>" and '\n'
+				auto tmp = sink.prepare(output.script.size() * 24 + 8 + 1);
 				putASM(tmp, output.script);
 				serial::put<char>(tmp, '\n');
-				const auto lineLength = buffer.size() - tmp.size();
-
-				// FIXME: stdout is non-atomic past 4096
-				if (lineLength > 4096) continue;
-
-				fwrite(buffer.begin(), lineLength, 1, stdout);
+				sink.trim(tmp.size());
 			}
 
 			transactions.pop_front();
 		}
+
+		this->output.commit(sink);
 	}
 };
 
 // BLOCK_HEADER > stdout
 template <typename Block>
 struct dumpHeaders : public TransformBase<Block> {
+	bool headerOnly () const { return true; }
+
 	void operator() (const Block& block) {
 		if (this->shouldSkip(block)) return;
 
-		fwrite(block.header.begin(), 80, 1, stdout);
+		auto& sink = this->output.local();
+		sink.put(block.header);
+		this->output.commit(sink);
 	}
 };
 
 // SCRIPT_LENGTH | SCRIPT > stdout
 template <typename Block>
 struct dumpScripts : public TransformBase<Block> {
+	bool splittable () const { return true; }
+
 	void operator() (const Block& block) {
+		this->operator()(block, block.whole());
+	}
+
+	void operator() (const Block& block, const typename Block::Part& part) {
 		if (this->shouldSkip(block)) return;
 
-		std::array<uint8_t, 4096> buffer;
-		const auto maxScriptLength = buffer.size() - sizeof(uint16_t);
+		auto& sink = this->output.local();
+		const auto put = [&](const auto& script) {
+			if (script.size() > 0xffff) return;
 
-		auto transactions = block.transactions();
+			auto r = sink.prepare(sizeof(uint16_t));
+			serial::put<uint16_t>(r, static_cast<uint16_t>(script.size()));
+			sink.put(script);
+		};
+
+		auto transactions = block.transactions(part);
 		while (not transactions.empty()) {
 			const auto& transaction = transactions.front();
 
-			for (const auto& input : transaction.inputs) {
-				if (input.script.size() > maxScriptLength) continue;
-
-				auto r = range(buffer);
-				serial::put<uint16_t>(r, static_cast<uint16_t>(input.script.size()));
-				r.put(input.script);
-				fwrite(buffer.begin(), buffer.size() - r.size(), 1, stdout);
-			}
-
-			for (const auto& output : transaction.outputs) {
-				if (output.script.size() > maxScriptLength) continue;
-
-				auto r = range(buffer);
-				serial::put<uint16_t>(r, static_cast<uint16_t>(output.script.size()));
-				r.put(output.script);
-				fwrite(buffer.begin(), buffer.size() - r.size(), 1, stdout);
-			}
+			for (const auto& input : transaction.inputs) put(input.script);
+			for (const auto& output : transaction.outputs) put(output.script);
 
 			transactions.pop_front();
 		}
+
+		this->output.commit(sink);
 	}
 };
 
@@ -187,10 +233,13 @@ struct dumpUnspents : public TransformBase<Block> {
 		std::vector<Txin> txins;
 		std::vector<Txo> txos;
 
+		const auto txHashes = block.transactionHashes();
+		size_t txIndex = 0;
+
 		auto transactions = block.transactions();
 		while (not transactions.empty()) {
 			const auto& transaction = transactions.front();
-			const auto txHash = transaction.hash();
+			const auto& txHash = txHashes[txIndex++];
 
 			for (const auto& input : transaction.inputs) {
 				uint256_t prevTxHash;
@@ -232,6 +281,9 @@ struct dumpUnspents : public TransformBase<Block> {
 			}
 		), this->unspents.end());
 
-		std::cout << this->unspents.size() << std::endl;
+		auto& sink = this->output.local();
+		const auto line = std::to_string(this->unspents.size()) + '\n';
+		sink.put(line);
+		this->output.commit(sink);
 	}
 };
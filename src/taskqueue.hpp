@@ -0,0 +1,274 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <thread>
+#include <vector>
+
+namespace {
+	// spin, then yield, then sleep
+	struct Backoff {
+		size_t attempts = 0;
+
+		void operator() () {
+			++this->attempts;
+
+			if (this->attempts < 64) return;
+			if (this->attempts < 128) return std::this_thread::yield();
+			std::this_thread::sleep_for(std::chrono::microseconds(50));
+		}
+	};
+}
+
+// a bounded multi-producer, multi-consumer FIFO ring, without locks
+// each cell has a sequence number, telling producers and consumers whose turn it is
+// after Dmitry Vyukov's bounded MPMC queue
+template <typename T>
+struct TaskQueue {
+private:
+	struct Cell {
+		std::atomic_size_t sequence;
+		alignas(T) unsigned char storage[sizeof(T)];
+	};
+
+	std::unique_ptr<Cell[]> _cells;
+	const size_t _mask;
+
+	alignas(64) std::atomic_size_t _head;
+	alignas(64) std::atomic_size_t _tail;
+	alignas(64) std::atomic_bool _closed;
+
+	static auto distance (const size_t a, const size_t b) {
+		return static_cast<std::ptrdiff_t>(a - b);
+	}
+
+public:
+	TaskQueue (const size_t capacity) : _cells(new Cell[capacity]), _mask(capacity - 1), _head(0), _tail(0), _closed(false) {
+		assert(capacity >= 2);
+		assert((capacity & this->_mask) == 0);
+
+		for (size_t i = 0; i < capacity; ++i) {
+			this->_cells[i].sequence.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	TaskQueue (const TaskQueue&) = delete;
+	TaskQueue& operator= (const TaskQueue&) = delete;
+
+	~TaskQueue () {
+		while (this->tryPop()) {}
+	}
+
+	bool tryPush (const T& value) {
+		auto position = this->_head.load(std::memory_order_relaxed);
+
+		while (true) {
+			auto& cell = this->_cells[position & this->_mask];
+			const auto sequence = cell.sequence.load(std::memory_order_acquire);
+			const auto diff = distance(sequence, position);
+
+			// full
+			if (diff < 0) return false;
+
+			// another producer took this cell
+			if (diff > 0) {
+				position = this->_head.load(std::memory_order_relaxed);
+				continue;
+			}
+
+			if (this->_head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+				new (cell.storage) T(value);
+				cell.sequence.store(position + 1, std::memory_order_release);
+				return true;
+			}
+		}
+	}
+
+	std::optional<T> tryPop () {
+		auto position = this->_tail.load(std::memory_order_relaxed);
+
+		while (true) {
+			auto& cell = this->_cells[position & this->_mask];
+			const auto sequence = cell.sequence.load(std::memory_order_acquire);
+			const auto diff = distance(sequence, position + 1);
+
+			// empty
+			if (diff < 0) return std::nullopt;
+
+			// another consumer took this cell
+			if (diff > 0) {
+				position = this->_tail.load(std::memory_order_relaxed);
+				continue;
+			}
+
+			if (this->_tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+				const auto pointer = std::launder(reinterpret_cast<T*>(cell.storage));
+				std::optional<T> value(std::move(*pointer));
+				pointer->~T();
+
+				cell.sequence.store(position + this->_mask + 1, std::memory_order_release);
+				return value;
+			}
+		}
+	}
+
+	// blocks while the queue is full
+	void push (const T& value) {
+		assert(not this->_closed);
+
+		Backoff backoff;
+		while (not this->tryPush(value)) backoff();
+	}
+
+	// blocks while the queue is empty, returns nothing once closed and drained
+	std::optional<T> pop () {
+		Backoff backoff;
+
+		while (true) {
+			const auto closed = this->_closed.load(std::memory_order_acquire);
+
+			auto value = this->tryPop();
+			if (value) return value;
+			if (closed) return std::nullopt;
+
+			backoff();
+		}
+	}
+
+	// no more values will be pushed
+	void close () {
+		this->_closed.store(true, std::memory_order_release);
+	}
+
+	bool closed () const {
+		return this->_closed.load(std::memory_order_acquire);
+	}
+};
+
+// a deque owned by a single worker, which pushes and pops at the back, while idle workers steal from the front
+template <typename T>
+struct WorkDeque {
+private:
+	std::mutex _mutex;
+	std::deque<T> _values;
+	std::atomic_size_t _size;
+
+public:
+	WorkDeque () : _size(0) {}
+
+	void push (const T& value) {
+		std::lock_guard<std::mutex> lock(this->_mutex);
+		this->_values.push_back(value);
+		++this->_size;
+	}
+
+	std::optional<T> pop () {
+		if (this->_size == 0) return std::nullopt;
+
+		std::lock_guard<std::mutex> lock(this->_mutex);
+		if (this->_values.empty()) return std::nullopt;
+
+		std::optional<T> value(std::move(this->_values.back()));
+		this->_values.pop_back();
+		--this->_size;
+		return value;
+	}
+
+	std::optional<T> steal () {
+		if (this->_size == 0) return std::nullopt;
+
+		std::lock_guard<std::mutex> lock(this->_mutex);
+		if (this->_values.empty()) return std::nullopt;
+
+		std::optional<T> value(std::move(this->_values.front()));
+		this->_values.pop_front();
+		--this->_size;
+		return value;
+	}
+};
+
+// nThreads workers, taking tasks from a bounded queue
+// a worker may push parts of a task to its own deque, where idle workers may steal them
+// runTask(task, deque) and runPart(part) are called on the workers, parts before any new task
+template <typename T, typename P>
+struct WorkerPool {
+private:
+	TaskQueue<T> _queue;
+	std::vector<std::unique_ptr<WorkDeque<P>>> _deques;
+	std::vector<std::thread> _workers;
+
+	std::optional<P> steal (const size_t i) {
+		const auto n = this->_deques.size();
+		for (size_t j = 1; j < n; ++j) {
+			auto part = this->_deques[(i + j) % n]->steal();
+			if (part) return part;
+		}
+
+		return std::nullopt;
+	}
+
+public:
+	template <typename RT, typename RP>
+	WorkerPool (const size_t nThreads, const size_t capacity, RT runTask, RP runPart) : _queue(capacity) {
+		assert(nThreads > 0);
+
+		for (size_t i = 0; i < nThreads; ++i) {
+			this->_deques.emplace_back(new WorkDeque<P>());
+		}
+
+		for (size_t i = 0; i < nThreads; ++i) {
+			this->_workers.emplace_back([this, i, runTask, runPart]() {
+				auto& deque = *this->_deques[i];
+
+				Backoff backoff;
+				while (true) {
+					if (const auto part = this->steal(i)) {
+						runPart(*part);
+						backoff = Backoff();
+						continue;
+					}
+
+					const auto closed = this->_queue.closed();
+					if (const auto task = this->_queue.tryPop()) {
+						runTask(*task, deque);
+						backoff = Backoff();
+						continue;
+					}
+
+					if (closed) break;
+					backoff();
+				}
+			});
+		}
+	}
+
+	WorkerPool (const WorkerPool&) = delete;
+	WorkerPool& operator= (const WorkerPool&) = delete;
+
+	~WorkerPool () {
+		assert(this->_workers.empty());
+	}
+
+	// blocks while the queue is full
+	void push (const T& task) {
+		this->_queue.push(task);
+	}
+
+	// waits for the workers to finish every task
+	void join () {
+		this->_queue.close();
+		for (auto& worker : this->_workers) worker.join();
+		this->_workers.clear();
+	}
+
+	auto size () const {
+		return this->_deques.size();
+	}
+};
@@ -1,20 +1,51 @@
-// XXX: fwrite can be used without sizeof(sbuf) < PIPE_BUF (4096 bytes)
 #pragma once
 
+#include <algorithm>
+#include <cstdio>
 #include <cstring>
 #include <iostream>
+#include <optional>
+#include <vector>
 
 #include "bitcoin.hpp"
 #include "hash.hpp"
 #include "hvectors.hpp"
+#include "sink.hpp"
 
 template <typename Block>
 struct TransformBase {
 protected:
 	HVector<uint256_t, uint32_t> whitelist;
+	OutputSink output;
 
 public:
-	bool initialize (const char* arg) {
+	void setOutput (const std::string& fileName) {
+		this->output.open(fileName);
+
+		std::cerr << "Opened " << fileName << " for output" << std::endl;
+	}
+
+	// output is emitted in the order blocks were dispatched (in height order, if read selectively)
+	void setOrdered (const size_t limit) {
+		this->output.order(limit);
+	}
+
+	// hands the output of a block processed in parts to the calling thread's buffer, in order
+	void gather (std::vector<SinkBuffer>& parts) {
+		auto& buffer = this->output.local();
+		for (auto& part : parts) {
+			buffer.put(part.data);
+		}
+
+		this->output.commit(buffer);
+	}
+
+	// if ordered, must follow every call of operator() for a block
+	void complete (const size_t sequence) {
+		this->output.complete(sequence);
+	}
+
+	virtual bool initialize (const char* arg) {
 		if (strncmp(arg, "-w", 2) == 0) {
 			const auto fileName = std::string(arg + 2);
 			const auto file = fopen(fileName.c_str(), "r");
@@ -43,10 +74,30 @@ public:
 		return false;
 	}
 
+	auto whitelisting () const {
+		return not this->whitelist.empty();
+	}
+
+	// the height of a whitelisted hash, if any
+	std::optional<uint32_t> whitelisted (const uint256_t& hash) const {
+		const auto iter = this->whitelist.find(hash);
+		if (iter == this->whitelist.end()) return std::nullopt;
+
+		return iter->second;
+	}
+
+	// the height of the blocks next processed on the calling thread, when known without a whitelist (e.g from the index)
+	static void setHeight (const uint32_t height) {
+		TransformBase::height() = height;
+	}
+
 	bool shouldSkip (const Block& block, uint256_t* _hash = nullptr, uint32_t* _height = nullptr) const {
-		if (this->whitelist.empty()) return false;
+		if (this->whitelist.empty()) {
+			if (_height != nullptr) *_height = TransformBase::height();
+			return false;
+		}
 
-		const auto hash = block.hash();
+		const auto& hash = block.hash();
 		const auto iter = this->whitelist.find(hash);
 		if (iter == this->whitelist.end()) return true;
 
@@ -57,4 +108,17 @@ public:
 
 	virtual ~TransformBase () {}
 	virtual void operator() (const Block&) = 0;
+
+	// a transform that only looks at the header may be given blocks with no transaction data
+	virtual bool headerOnly () const { return false; }
+
+	// a transform that only looks at transactions may be given a large block in parts, on many workers
+	virtual bool splittable () const { return false; }
+	virtual void operator() (const Block&, const typename Block::Part&) { assert(false); }
+
+private:
+	static uint32_t& height () {
+		thread_local uint32_t height = 0xffffffff;
+		return height;
+	}
 };